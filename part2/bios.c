@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/uio.h>
 
 #include "util.h"
 #include "bios.h"
@@ -44,6 +45,7 @@ typedef struct core
 
 	interrupt_handler* intvec[maximum_interrupt_no];
 	sig_atomic_t intpending[maximum_interrupt_no];
+	serial_mask_t serial_pending[maximum_interrupt_no];	/* devices raising each interrupt */
 
 	sig_atomic_t int_disabled;
 	sig_atomic_t halted;
@@ -72,6 +74,9 @@ static sigset_t sigalrm_set;
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
+/* Used to store the singleton set containing SIGPIPE */
+static sigset_t sigpipe_set;
+
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
 
@@ -145,6 +150,10 @@ static void initialize()
 	CHECK(sigemptyset(&signalfd_set));
 	CHECK(sigaddset(&signalfd_set, SIGUSR1));
 	CHECK(sigaddset(&signalfd_set, SIGALRM));
+
+	/* Create the mask for SIGPIPE (the PIC writes to the consoles) */
+	CHECK(sigemptyset(&sigpipe_set));
+	CHECK(sigaddset(&sigpipe_set, SIGPIPE));
 }
 
 
@@ -187,6 +196,7 @@ static void* bootfunc_wrapper(void* _core)
 	for(int i=0; i<maximum_interrupt_no; i++) {
 		core->intvec[i] = NULL;
 		core->intpending[i] = 0;
+		core->serial_pending[i] = 0;
 	}
 
 	/* Mark interrupts as enabled */
@@ -249,6 +259,16 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 }
 
 
+/*
+	Raise a serial interrupt to a core, on behalf of a serial device.
+ */
+static inline void raise_serial_interrupt(Core* core, Interrupt intno, uint serial)
+{
+	__atomic_fetch_or(& core->serial_pending[intno], ((serial_mask_t)1)<<serial, __ATOMIC_RELEASE);
+	raise_interrupt(core, intno);
+}
+
+
 /*
 	Dispatch the pending iterrupts for the given core.
  */
@@ -311,12 +331,17 @@ coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	Transfers do not touch the fd directly. Instead, they move bytes to/from a 
+	host-side ring buffer, and the PIC thread performs the I/O operations between
+	the ring and the fd, in large batches.
 
-	A not-ready device is made ready when select() returns it as such.
+	An io_device is ready if I/O transfers may succeed (there is data in the ring 
+	for RX, or space for TX).
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
+	A not-ready device is made ready when the PIC thread moves data to/from the fd.
+
 	When a not-ready device becomes ready, an interrupt is raised.
  */
 
@@ -326,6 +351,102 @@ typedef enum io_direction
 	IODIR_TX
 } io_direction;
 
+
+/*
+	Each io_device is buffered on the host side by a serial_ring.
+
+	The ring is a single-producer/single-consumer byte queue. For an RX device,
+	the PIC thread is the producer (it fills the ring from the fd) and the cores
+	are the consumer. For a TX device, the roles are reversed. In this way, a core
+	moves a whole batch of bytes with a memcpy, and the PIC thread moves them
+	to/from the fd with a single system call.
+
+	The head and tail counters increase monotonically; their difference is
+	the number of bytes in the ring. Cores may call the bios from several threads,
+	therefore the core side of the ring is serialized by a spinlock.
+ */
+#define SERIAL_BUFFER_SIZE (16*1024)
+
+typedef struct serial_ring
+{
+	char data[SERIAL_BUFFER_SIZE];
+	unsigned long head;			/* total bytes put into the ring */
+	unsigned long tail;			/* total bytes taken out of the ring */
+	char core_lock;				/* serializes core-side access */
+} serial_ring;
+
+
+static void serial_ring_init(serial_ring* this)
+{
+	this->head = this->tail = 0;
+	this->core_lock = 0;
+}
+
+static inline uint serial_ring_count(serial_ring* this)
+{
+	unsigned long tail = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+	unsigned long head = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+	return head - tail;
+}
+
+static inline uint serial_ring_space(serial_ring* this)
+{
+	return SERIAL_BUFFER_SIZE - serial_ring_count(this);
+}
+
+/*
+	Describe the (at most two) contiguous segments of 'size' bytes starting at 
+	counter 'pos'.
+ */
+static int serial_ring_iov(serial_ring* this, unsigned long pos, uint size, struct iovec* iov)
+{
+	uint off = pos % SERIAL_BUFFER_SIZE;
+	uint first = (off+size <= SERIAL_BUFFER_SIZE) ? size : SERIAL_BUFFER_SIZE - off;
+
+	iov[0].iov_base = this->data + off;
+	iov[0].iov_len = first;
+	iov[1].iov_base = this->data;
+	iov[1].iov_len = size - first;
+	return (size > first) ? 2 : 1;
+}
+
+
+/* Copy up to size bytes into the ring (producer side) */
+static uint serial_ring_put(serial_ring* this, const char* buf, uint size)
+{
+	uint space = serial_ring_space(this);
+	if(size > space) size = space;
+	if(size==0) return 0;
+
+	struct iovec iov[2];
+	int n = serial_ring_iov(this, this->head, size, iov);
+	for(int i=0; i<n; i++) {
+		memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+	__atomic_add_fetch(&this->head, size, __ATOMIC_RELEASE);
+	return size;
+}
+
+
+/* Copy up to size bytes out of the ring (consumer side) */
+static uint serial_ring_get(serial_ring* this, char* buf, uint size)
+{
+	uint count = serial_ring_count(this);
+	if(size > count) size = count;
+	if(size==0) return 0;
+
+	struct iovec iov[2];
+	int n = serial_ring_iov(this, this->tail, size, iov);
+	for(int i=0; i<n; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+	__atomic_add_fetch(&this->tail, size, __ATOMIC_RELEASE);
+	return size;
+}
+
+
 /*
 	An io_device is a file descriptor from which we either read or write bytes.
  */
@@ -337,62 +458,154 @@ typedef struct io_device
 	volatile Core* int_core;		/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	coarse_clock_t last_int;	/* used for timeouts */
-} io_device;
 
+	serial_ring ring;			/* host-side buffer */
+} io_device;
 
-static int io_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
-}
 
 static void io_device_init(io_device* this, int fd, io_direction iodir)
 {
 	this->fd = fd;
 	this->iodir = iodir;
 	this->int_core = &CORE[0];
-	this->ready = io_ready(fd, iodir);
+	this->ready = 1;
 	this->last_int = system_clock;
+	serial_ring_init(& this->ring);
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Core-side locking of the ring. Interrupts for this core are held back 
+	(by just raising the int_disabled flag, which the SIGUSR1 handler respects),
+	so that a handler cannot run, and possibly yield, while the lock is held.
+ */
+static inline int io_device_lock(io_device* this)
 {
-	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+	Core* core = curr_core();
+	int int_disabled = core->int_disabled;
+	core->int_disabled = 1;
+	while(__atomic_test_and_set(& this->ring.core_lock, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(& this->ring.core_lock, __ATOMIC_RELAXED))
+			__builtin_ia32_pause();
+	return int_disabled;
+}
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
+static inline void io_device_unlock(io_device* this, int int_disabled)
+{
+	__atomic_clear(& this->ring.core_lock, __ATOMIC_RELEASE);
+	if(! int_disabled) {
+		Core* core = curr_core();
+		core->int_disabled = 0;
+		dispatch_interrupts(core);
+	}
+}
+
+
+/*
+	Mark the device as not-ready, because a transfer found no data (RX) or no 
+	space (TX). The PIC will raise an interrupt once it changes this. The 
+	caller must re-check the ring afterwards, to avoid a lost wakeup.
+ */
+static inline void io_device_not_ready(io_device* this)
+{
+	if(__atomic_exchange_n(& this->ready, 0, __ATOMIC_SEQ_CST)) 
 		interrupt_pic_thread();
+}
+
+/*
+	Called by the PIC after it has moved data to/from the fd. It returns 1 if 
+	some core was waiting for the device to become ready.
+ */
+static inline int io_device_make_ready(io_device* this)
+{
+	return __atomic_exchange_n(& this->ready, 1, __ATOMIC_SEQ_CST)==0;
+}
+
+
+static uint io_device_read(io_device* this, char* buf, uint size)
+{
+	assert(this->iodir == IODIR_RX);
+
+	int int_disabled = io_device_lock(this);
+	int was_full = (serial_ring_space(& this->ring) == 0);
+	uint count = serial_ring_get(& this->ring, buf, size);
+	if(count==0) {
+		io_device_not_ready(this);
+		count = serial_ring_get(& this->ring, buf, size);
 	}
-	return rc==1;
+	io_device_unlock(this, int_disabled);
+
+	/* The PIC does not poll a full ring; let it know there is room */
+	if(was_full && count>0) 
+		interrupt_pic_thread();
+	return count;
 }
 
 
-static int io_device_write(io_device* this, char value)
+static uint io_device_write(io_device* this, const char* buf, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
-	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
-
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+	int int_disabled = io_device_lock(this);
+	int was_empty = (serial_ring_count(& this->ring) == 0);
+	uint count = serial_ring_put(& this->ring, buf, size);
+	if(count==0) {
+		io_device_not_ready(this);
+		count = serial_ring_put(& this->ring, buf, size);
+	}
+	io_device_unlock(this, int_disabled);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
+	/* The PIC does not poll an empty ring; let it know there is data */
+	if(was_empty && count>0)
 		interrupt_pic_thread();
-	} 
+	return count;
+}
 
-	return rc==1;
+
+/*
+	PIC-side transfers. Move as many bytes as possible between the fd and the 
+	ring, in one system call. Return the number of bytes moved.
+ */
+static uint io_device_fill(io_device* this)
+{
+	assert(this->iodir == IODIR_RX);
+	serial_ring* ring = & this->ring;
+
+	uint space = serial_ring_space(ring);
+	if(space==0) return 0;
+
+	struct iovec iov[2];
+	int n = serial_ring_iov(ring, ring->head, space, iov);
+	ssize_t rc;
+	while((rc=readv(this->fd, iov, n))==-1 && errno == EINTR);
+	assert(rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+	if(rc<=0) return 0;
+
+	__atomic_add_fetch(&ring->head, rc, __ATOMIC_RELEASE);
+	return rc;
+}
+
+
+static uint io_device_drain(io_device* this)
+{
+	assert(this->iodir == IODIR_TX);
+	serial_ring* ring = & this->ring;
+
+	uint count = serial_ring_count(ring);
+	if(count==0) return 0;
+
+	struct iovec iov[2];
+	int n = serial_ring_iov(ring, ring->tail, count, iov);
+	ssize_t rc;
+	while((rc=writev(this->fd, iov, n))==-1 && errno == EINTR);
+	assert(rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE)));
+	if(rc<=0) return 0;
+
+	__atomic_add_fetch(&ring->tail, rc, __ATOMIC_RELEASE);
+	return rc;
 }
 
 
@@ -491,6 +704,26 @@ static void pic_drain_sigusr1(int sigusr1fd)
 }
 
 
+/* 
+	Helper for PIC_daemon: at shutdown, write out the console ring, waiting
+	for the terminal for at most SERIAL_TIMEOUT ticks of no progress.
+ */
+static void pic_flush_console(terminal* term)
+{
+	io_device* con = & term->con;
+	while(serial_ring_count(& con->ring) > 0) {
+		struct pollfd fds = { .fd=con->fd, .events=POLLOUT };
+		int rc;
+		do {
+			rc = poll(&fds, 1, SERIAL_TIMEOUT*SLOW_HZ/1000);
+		} while(rc == -1 && errno==EINTR);
+		CHECK(rc);
+		if(rc==0 || (fds.revents & (POLLHUP|POLLERR))) break;
+		if(io_device_drain(con)==0) break;
+	}
+}
+
+
 /*
 	The PIC daemon is the dispatcher on interrupts to core threads,
 	by calling raise_interrupt().
@@ -524,6 +757,7 @@ static void PIC_daemon(uint serialno)
 	CHECK(sigalrmfd);
 
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigpipe_set, NULL));
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -540,8 +774,10 @@ static void PIC_daemon(uint serialno)
 		for(uint i=0; i<nterm; i++) {
 			terminal* term = & TERM[i];
 			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
+			if(serial_ring_space(& term->kbd.ring) > 0) 
+				fdset_add(&readfds, term->kbd.fd, &maxfd);
+			if(serial_ring_count(& term->con.ring) > 0) 
+				fdset_add(&writefds, term->con.fd, &maxfd);
 		}
 
 		fdset_add(&readfds, sigalrmfd, &maxfd);
@@ -585,25 +821,27 @@ static void PIC_daemon(uint serialno)
 		for(uint i=0; i<nterm; i++) {
 
 			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
+			uint moved;
+
+			moved = FD_ISSET(term->con.fd, &writefds) ? io_device_drain(& term->con) : 0;
+			if( (moved>0 && io_device_make_ready(& term->con))
 				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
 				) 
 			{
-				term->con.ready = 1;
 				term->con.last_int = system_clock;
 				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
+				raise_serial_interrupt(core, SERIAL_TX_READY, i);
 			}
 
 
-			if( FD_ISSET(term->kbd.fd, &readfds) 
+			moved = FD_ISSET(term->kbd.fd, &readfds) ? io_device_fill(& term->kbd) : 0;
+			if( (moved>0 && io_device_make_ready(& term->kbd))
 				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
 				) 
 			{
-				term->kbd.ready = 1;
 				term->kbd.last_int = system_clock;
 				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
+				raise_serial_interrupt(core, SERIAL_RX_READY, i);
 			}
 		}
 	}
@@ -611,11 +849,19 @@ static void PIC_daemon(uint serialno)
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
+	/* Flush whatever the cores left in the console rings */
+	for(uint i=0; i<nterm; i++)
+		pic_flush_console(& TERM[i]);
+
 	/* Close signal fds */
 	pic_drain_sigusr1(sigusr1fd);
 	CHECK(close(sigalrmfd));
 	CHECK(close(sigusr1fd));
 
+	/* Discard any SIGPIPE raised by writing to a closed console */
+	struct timespec nowait = { 0, 0 };
+	while(sigtimedwait(&sigpipe_set, NULL, &nowait)==SIGPIPE) { }
+
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
 
@@ -873,13 +1119,24 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the set of serial devices which raised 'intno' to 
+	the current core.
+ */
+serial_mask_t bios_serial_pending(Interrupt intno)
+{
+	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
+	return __atomic_exchange_n(& curr_core()->serial_pending[intno], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -889,7 +1146,27 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Read up to 'size' bytes from serial port 'serial' into 'buf'. Return the 
+	number of bytes read, which is 0 if the device is not ready.
+ */
+uint bios_read_serial_n(uint serial, char* buf, uint size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write up to 'size' bytes from 'buf' to serial port 'serial'. Return the
+	number of bytes written, which is 0 if the device is not ready.
+ */
+uint bios_write_serial_n(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
 }
 
 
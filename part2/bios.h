@@ -84,19 +84,28 @@
 
 	./terminal 1
 
-	Data can be read from  a serial port, one byte at a time. A read
+	Data can be read from  a serial port, one byte at a time, or in batches
+	of many bytes. A read
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the read will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_RX_READY interrupt is raised.
 
-	Data can be written to a serial port, one byte at a time. A write
+	Data can be written to a serial port, one byte at a time, or in batches
+	of many bytes. A write
 	may fail if the device is not-ready to perform the operation. On a device
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
 
+	Each serial port is buffered by the VM, in both directions. Therefore, a batched 
+	transfer (see @c bios_read_serial_n and @c bios_write_serial_n) costs about as 
+	much as a single-byte one.
+
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	A serial interrupt handler can find which serial ports raised the interrupt,
+	by calling @c bios_serial_pending.
+
  */
 
 
@@ -131,6 +140,18 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** 
+	@brief A set of serial devices, one bit per device.
+
+	Bit @c n of the mask designates serial port @c n.
+	@see bios_serial_pending
+ */
+typedef uint64_t serial_mask_t;
+
+#if MAX_TERMINALS > 64
+#error "MAX_TERMINALS must fit in a serial_mask_t"
+#endif
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -320,6 +341,22 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Find which serial devices raised an interrupt.
+
+	Return the set of serial ports that have raised interrupt @c intno to the
+	current core, since the last call to this function. The set is cleared
+	by this call.
+
+	This is meant to be called by the handler of @c intno, so that only the
+	ready devices need to be serviced.
+
+	@param intno the interrupt (one of @c SERIAL_RX_READY and @c SERIAL_TX_READY)
+	@return a mask where bit @c n is set if serial port @c n raised @c intno
+ */
+serial_mask_t bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -354,4 +391,42 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read many bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial and store them
+	into @c buf. The number of bytes read is returned; it may be less than 
+	@c size, if fewer bytes have been received from the terminal. 
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised when
+	data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the read bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read, or 0 if the device is not ready
+	@see bios_read_serial
+ */
+uint bios_read_serial_n(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write many bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial. 
+	The number of bytes written is returned; it may be less than @c size, if
+	the device cannot accept more data at this time.
+
+	If this operation returns 0, a @c SERIAL_TX_READY interrupt will be raised when
+	the device is ready to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the number of bytes in @c buf
+	@return the number of bytes written, or 0 if the device is not ready
+	@see bios_write_serial
+ */
+uint bios_write_serial_n(uint serial, const char* buf, uint size);
+
+
 #endif
@@ -0,0 +1,342 @@
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+
+/*
+	Asynchronous I/O streams.
+
+	AioSubmit copies the entries of the submission ring into jobs, looking
+	up all their file ids under a single acquisition of kernel_mutex, and
+	queues them to the worker threads of the stream. Workers are kernel
+	threads (of the scheduler process), spawned on demand up to
+	AIO_MAX_WORKERS; each job pins its FCB, so workers never touch the
+	fid table of the process.
+
+	The stream is freed when it is closed and the last worker has exited.
+	Closing cancels the queued jobs, but not the running ones, which
+	still complete into the buffers of the process.
+ */
+
+#define AIO_MAX_ENTRIES 4096
+#define AIO_MAX_WORKERS 4
+
+typedef struct aio_job {
+	uint opcode;
+	FCB* fcb;
+	void* buf;
+	uint len;
+	unsigned long user_data;
+} aio_job;
+
+typedef struct aio_control_block {
+	aio_ring_t ring;		/* shared with the process */
+
+	Mutex submit_lock;		/* serializes AioSubmit, preemption on */
+
+	Mutex lock;				/* protects the rest, preemption off */
+	CondVar work;			/* idle workers wait here */
+	aio_job* jobs;			/* queued jobs, cq_entries of them */
+	unsigned long job_head, job_tail;
+	uint inflight;			/* taken from sq, not yet posted to cq */
+	uint workers;
+	uint idle;
+	int refcount;			/* the stream and the workers */
+	int closed;
+
+	wait_queue cq_queue;	/* pollers of completions */
+} AIOCB;
+
+static int aio_close(void* this);
+static uint aio_poll(void* this, poll_table* pt);
+
+file_ops AioOps = {
+	.Open = NULL,
+	.Close = aio_close,
+	.Poll = aio_poll
+};
+
+
+static void aio_free(AIOCB* cb)
+{
+	free(cb->ring.sq);
+	free(cb->ring.cq);
+	free(cb->jobs);
+	free(cb);
+}
+
+/* Called with cb->lock held */
+static void aio_post(AIOCB* cb, unsigned long user_data, int result)
+{
+	aio_ring_t* r = &cb->ring;
+	aio_cqe_t* cqe = & r->cq[r->cq_tail & (r->cq_entries-1)];
+	cqe->user_data = user_data;
+	cqe->result = result;
+	__atomic_store_n(&r->cq_tail, r->cq_tail+1, __ATOMIC_RELEASE);
+	cb->inflight--;
+}
+
+static inline unsigned long aio_completions(AIOCB* cb)
+{
+	return __atomic_load_n(&cb->ring.cq_tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&cb->ring.cq_head, __ATOMIC_ACQUIRE);
+}
+
+static uint aio_poll(void* this, poll_table* pt)
+{
+	AIOCB* cb = (AIOCB*) this;
+	poll_wait(pt, &cb->cq_queue);
+	return (aio_completions(cb) > 0) ? POLL_READ : 0;
+}
+
+
+static int aio_execute(aio_job* job)
+{
+	file_ops* ops = job->fcb->streamfunc;
+	void* sobj = job->fcb->streamobj;
+
+	switch(job->opcode) {
+	case AIO_READ:
+		return ops->Read ? ops->Read(sobj, job->buf, job->len) : -1;
+	case AIO_WRITE:
+		return ops->Write ? ops->Write(sobj, job->buf, job->len) : -1;
+	default:
+		return -1;
+	}
+}
+
+
+static void aio_worker()
+{
+	AIOCB* cb = (AIOCB*) CURTHREAD->thread_arg;
+
+	int pre = preempt_off;
+	Mutex_Lock(&cb->lock);
+	while(1) {
+		while(cb->job_head == cb->job_tail && ! cb->closed) {
+			cb->idle++;
+			Cond_Wait(&cb->lock, &cb->work);
+			cb->idle--;
+		}
+		if(cb->job_head == cb->job_tail) break;   /* closed */
+
+		aio_job job = cb->jobs[cb->job_head++ & (cb->ring.cq_entries-1)];
+		Mutex_Unlock(&cb->lock);
+		if(pre) preempt_on;
+
+		int result = aio_execute(&job);
+
+		Mutex_Lock(&kernel_mutex);
+		FCB_decref(job.fcb);
+		Mutex_Unlock(&kernel_mutex);
+
+		pre = preempt_off;
+		Mutex_Lock(&cb->lock);
+		aio_post(cb, job.user_data, result);
+		wait_queue_notify(&cb->cq_queue);
+	}
+
+	cb->workers--;
+	int last = (--cb->refcount == 0);
+	Mutex_Unlock(&cb->lock);
+	if(last) aio_free(cb);
+
+	sleep_releasing(EXITED, NULL);
+}
+
+
+/* Called with kernel_mutex held, from FCB_decref */
+static int aio_close(void* this)
+{
+	AIOCB* cb = (AIOCB*) this;
+
+	/* Room for the jobs which may be queued */
+	FCB** cancelled = (FCB**) xmalloc(cb->ring.cq_entries*sizeof(FCB*));
+	uint ncancelled = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(&cb->lock);
+	cb->closed = 1;
+	/* Cancel the jobs which have not started */
+	while(cb->job_head != cb->job_tail) {
+		aio_job* job = & cb->jobs[cb->job_head++ & (cb->ring.cq_entries-1)];
+		cancelled[ncancelled++] = job->fcb;
+		cb->inflight--;
+	}
+	Cond_Broadcast(&cb->work);
+	int last = (--cb->refcount == 0);
+	Mutex_Unlock(&cb->lock);
+	if(pre) preempt_on;
+
+	/* Closing a stream may block, so it is done without the spinlock */
+	for(uint i=0; i<ncancelled; i++)
+		FCB_decref(cancelled[i]);
+	free(cancelled);
+
+	if(last) aio_free(cb);
+	return 0;
+}
+
+
+Fid_t AioSetup(unsigned int entries, aio_ring_t** ring)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(entries == 0 || entries > AIO_MAX_ENTRIES || ring == NULL)
+		return NOFILE;
+
+	uint size = 1;
+	while(size < entries) size <<= 1;
+
+	Mutex_Lock(&kernel_mutex);
+	if(! FCB_reserve(1, &fid, &fcb)) {
+		Mutex_Unlock(&kernel_mutex);
+		return NOFILE;
+	}
+
+	AIOCB* cb = (AIOCB*) xmalloc(sizeof(AIOCB));
+	cb->ring.sq_head = cb->ring.sq_tail = 0;
+	cb->ring.cq_head = cb->ring.cq_tail = 0;
+	cb->ring.sq_entries = size;
+	cb->ring.cq_entries = 2*size;
+	cb->ring.sq = (aio_sqe_t*) xmalloc(size*sizeof(aio_sqe_t));
+	cb->ring.cq = (aio_cqe_t*) xmalloc(2*size*sizeof(aio_cqe_t));
+	cb->submit_lock = MUTEX_INIT;
+	cb->lock = MUTEX_INIT;
+	cb->work = COND_INIT;
+	cb->jobs = (aio_job*) xmalloc(2*size*sizeof(aio_job));
+	cb->job_head = cb->job_tail = 0;
+	cb->inflight = 0;
+	cb->workers = cb->idle = 0;
+	cb->refcount = 1;
+	cb->closed = 0;
+	wait_queue_init(&cb->cq_queue);
+
+	FCB_setup(fcb, cb, &AioOps);
+	Mutex_Unlock(&kernel_mutex);
+
+	*ring = &cb->ring;
+	return fid;
+}
+
+
+/*
+	Take the filled submission entries, as long as their completions fit.
+	Returns the number of entries taken. Called with submit_lock held.
+ */
+static uint aio_take(AIOCB* cb)
+{
+	aio_ring_t* r = &cb->ring;
+	unsigned long head = r->sq_head;
+	unsigned long filled = __atomic_load_n(&r->sq_tail, __ATOMIC_ACQUIRE) - head;
+	if(filled > r->sq_entries) filled = r->sq_entries;   /* a confused process */
+
+	/* Completions only move from inflight to the cq, so room only grows */
+	unsigned long used = aio_completions(cb) + __atomic_load_n(&cb->inflight, __ATOMIC_ACQUIRE);
+	unsigned long room = (used < r->cq_entries) ? r->cq_entries - used : 0;
+	uint n = (filled < room) ? filled : room;
+	if(n == 0) return 0;
+
+	/* Copy the entries and resolve their file ids under one lock acquisition */
+	aio_job* batch = (aio_job*) xmalloc(n*sizeof(aio_job));
+	Mutex_Lock(&kernel_mutex);
+	for(uint i=0; i<n; i++) {
+		aio_sqe_t* sqe = & r->sq[(head+i) & (r->sq_entries-1)];
+		batch[i].opcode = sqe->opcode;
+		batch[i].buf = sqe->buf;
+		batch[i].len = sqe->len;
+		batch[i].user_data = sqe->user_data;
+		batch[i].fcb = NULL;
+		if(sqe->opcode == AIO_READ || sqe->opcode == AIO_WRITE) {
+			batch[i].fcb = get_fcb(sqe->fid);
+			if(batch[i].fcb) FCB_incref(batch[i].fcb);
+		}
+	}
+	Mutex_Unlock(&kernel_mutex);
+	__atomic_store_n(&r->sq_head, head+n, __ATOMIC_RELEASE);
+
+	/* Queue the jobs, and see if more workers are needed */
+	int pre = preempt_off;
+	Mutex_Lock(&cb->lock);
+	cb->inflight += n;
+	for(uint i=0; i<n; i++) {
+		aio_job* job = &batch[i];
+		if(job->opcode == AIO_NOP)
+			aio_post(cb, job->user_data, 0);
+		else if(job->fcb == NULL)    /* bad fid or opcode */
+			aio_post(cb, job->user_data, -1);
+		else
+			cb->jobs[cb->job_tail++ & (r->cq_entries-1)] = *job;
+	}
+	uint queued = cb->job_tail - cb->job_head;
+	uint spawn = (queued > cb->idle) ? queued - cb->idle : 0;
+	if(spawn > AIO_MAX_WORKERS - cb->workers) spawn = AIO_MAX_WORKERS - cb->workers;
+	cb->workers += spawn;
+	cb->refcount += spawn;
+	if(queued > 0) Cond_Broadcast(&cb->work);
+	Mutex_Unlock(&cb->lock);
+	wait_queue_notify(&cb->cq_queue);
+	if(pre) preempt_on;
+
+	for(uint i=0; i<spawn; i++) {
+		TCB* tcb = spawn_thread(get_pcb(0), aio_worker);
+		tcb->thread_arg = cb;
+		wakeup(tcb);
+	}
+
+	free(batch);
+	return n;
+}
+
+
+int AioSubmit(Fid_t aio, unsigned int min_complete, timeout_t timeout)
+{
+	Mutex_Lock(&kernel_mutex);
+	FCB* fcb = get_fcb(aio);
+	if(fcb == NULL || fcb->streamfunc != &AioOps) {
+		Mutex_Unlock(&kernel_mutex);
+		return -1;
+	}
+	FCB_incref(fcb);
+	Mutex_Unlock(&kernel_mutex);
+
+	AIOCB* cb = (AIOCB*) fcb->streamobj;
+
+	Mutex_Lock(&cb->submit_lock);
+	int submitted = aio_take(cb);
+	Mutex_Unlock(&cb->submit_lock);
+
+	if(min_complete > cb->ring.cq_entries)
+		min_complete = cb->ring.cq_entries;
+
+	if(aio_completions(cb) < min_complete && timeout != 0) {
+		poll_table pt;
+		poll_table_init(&pt);
+		pt.size = 1;
+		pt.entries = (poll_entry*) xmalloc(sizeof(poll_entry));
+		poll_wait(&pt, &cb->cq_queue);
+
+		long deadline = (timeout > 0) ? poll_clock_ms() + timeout : 0;
+		while(1) {
+			__atomic_store_n(&pt.triggered, 0, __ATOMIC_SEQ_CST);
+			if(aio_completions(cb) >= min_complete) break;
+
+			timeout_t left = -1;
+			if(timeout > 0) {
+				left = deadline - poll_clock_ms();
+				if(left <= 0) break;
+			}
+			if(! poll_table_wait(&pt, left)) break;
+		}
+		poll_table_release(&pt);
+	}
+
+	Mutex_Lock(&kernel_mutex);
+	FCB_decref(fcb);
+	Mutex_Unlock(&kernel_mutex);
+	return submitted;
+}
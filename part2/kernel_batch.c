@@ -0,0 +1,48 @@
+
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_proc.h"
+
+/*
+	Batched system calls.
+
+	The operations are executed by the same routines as the corresponding
+	system calls, under a single acquisition of kernel_mutex.
+ */
+
+static int sysop_execute(sysop_t* op)
+{
+	switch(op->op) {
+	case SYS_PIPE: {
+		pipe_t pipe;
+		if(pipe_create(&pipe, PIPE_STREAM) != 0) return -1;
+		op->fid[0] = pipe.read;
+		op->fid[1] = pipe.write;
+		return 0;
+	}
+	case SYS_DUP2:
+		return fid_dup2(op->fid[0], op->fid[1]);
+	case SYS_CLOSE:
+		return fid_close(op->fid[0]);
+	case SYS_EXEC:
+		return exec_process(op->task, op->argl, op->args);
+	default:
+		return -1;
+	}
+}
+
+
+int SysBatch(sysop_t* ops, unsigned int n)
+{
+	if(ops == NULL) return -1;
+
+	int succeeded = 0;
+	Mutex_Lock(&kernel_mutex);
+	for(uint i = 0; i < n; i++) {
+		ops[i].result = sysop_execute(&ops[i]);
+		if(ops[i].result != -1) succeeded++;   /* -1 is also NOPROC */
+	}
+	Mutex_Unlock(&kernel_mutex);
+	return succeeded;
+}
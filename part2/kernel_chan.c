@@ -0,0 +1,379 @@
+
+#include <stdint.h>
+#include <string.h>
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+
+/*
+	Channels.
+
+	A channel is a ring of fixed-size slots. Transfers follow the three
+	stages of io_buffer: reserve a slot, transfer the record, release the
+	slot. The ring state is a pair of 64-bit indices, which increase
+	forever, so they never wrap around.
+
+	With many producers, slots may be released out of order. Therefore,
+	instead of an 'available' count, each slot carries a sequence number,
+	which tells whether it is free for index i (seq == i) or holds the
+	record of index i (seq == i+1). Reservations are a compare-exchange
+	on the index; releases are a store to the sequence number of the slot.
+	Neither takes a lock.
+
+	Threads only block on an empty or full ring, by registering on the
+	wait queue of the other side and retrying. Releases notify the wait
+	queue, which costs a load when nobody is waiting.
+
+	Like a pipe, a channel has a send end and a receive end. When the
+	send end is closed, receivers drain the ring and then see end of 
+	file; when the receive end is closed, sends fail. A stream is only 
+	closed when no call is using it, so no send is in progress once 
+	the send end is closed.
+ */
+
+#define CHAN_MAX_SLOTS (1u<<16)
+#define CHAN_MAX_SLOTSIZE (1u<<16)
+
+typedef struct chan_slot {
+	uint64_t seq;
+	uint len;
+	char data[];
+} chan_slot;
+
+typedef struct channel_control_block {
+	uint64_t head __attribute__((aligned(64)));   /* next record to receive */
+	uint64_t tail __attribute__((aligned(64)));   /* next slot to send into */
+
+	uint slots;				/* a power of 2 */
+	uint slotsize;
+	size_t stride;			/* bytes per slot, with the header */
+	char* ring;
+
+	wait_queue not_empty;	/* receivers wait here */
+	wait_queue not_full;	/* senders wait here */
+
+	int senders_closed;
+	int receivers_closed;
+} CHANCB;
+
+static int chan_read(void* this, char* buf, uint size);
+static int chan_write(void* this, const char* buf, uint size);
+static int chan_readv(void* this, const iovec_t* iov, uint iovcnt, uint flags);
+static int chan_writev(void* this, const iovec_t* iov, uint iovcnt, uint flags);
+static int chan_sender_close(void* this);
+static int chan_receiver_close(void* this);
+static uint chan_sender_poll(void* this, poll_table* pt);
+static uint chan_receiver_poll(void* this, poll_table* pt);
+
+file_ops ChanSenderOps = {
+	.Open = NULL,
+	.Write = chan_write,
+	.Close = chan_sender_close,
+	.Poll = chan_sender_poll,
+	.WriteV = chan_writev
+};
+
+file_ops ChanReceiverOps = {
+	.Open = NULL,
+	.Read = chan_read,
+	.Close = chan_receiver_close,
+	.Poll = chan_receiver_poll,
+	.ReadV = chan_readv
+};
+
+
+static inline chan_slot* chan_slot_at(CHANCB* ch, uint64_t i)
+{
+	return (chan_slot*) (ch->ring + (i & (ch->slots-1)) * ch->stride);
+}
+
+
+/*
+	Reserve the slot of the next index of a side (head or tail).
+	A slot is ready for the side at index i when its sequence number
+	is i+lag: lag is 0 for senders and 1 for receivers.
+	Returns NULL if the ring is full (resp. empty).
+ */
+static chan_slot* chan_reserve(CHANCB* ch, uint64_t* index, uint64_t lag, uint64_t* pos)
+{
+	uint64_t i = __atomic_load_n(index, __ATOMIC_RELAXED);
+	while(1) {
+		chan_slot* slot = chan_slot_at(ch, i);
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (i + lag));
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(index, &i, i+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = i;
+				return slot;
+			}
+			/* i was reloaded by the failed exchange */
+		}
+		else if(diff < 0)
+			return NULL;
+		else
+			i = __atomic_load_n(index, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* Hand the slot to the other side, and wake it up if it is waiting */
+static void chan_release(chan_slot* slot, uint64_t seq, wait_queue* q)
+{
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	/* Order the release before the check for waiters */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wait_queue_notify(q);
+}
+
+
+/* A record is gathered from (scattered to) all the segments of a transfer */
+static int chan_try_send(CHANCB* ch, const iovec_t* iov, uint iovcnt, uint size)
+{
+	uint64_t pos;
+	chan_slot* slot = chan_reserve(ch, &ch->tail, 0, &pos);
+	if(slot == NULL) return 0;
+
+	char* data = slot->data;
+	for(uint i=0; i<iovcnt; i++) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	slot->len = size;
+	chan_release(slot, pos+1, &ch->not_empty);
+	return 1;
+}
+
+static int chan_try_recv(CHANCB* ch, const iovec_t* iov, uint iovcnt, int* len)
+{
+	uint64_t pos;
+	chan_slot* slot = chan_reserve(ch, &ch->head, 1, &pos);
+	if(slot == NULL) return 0;
+
+	uint n = 0;
+	for(uint i=0; i<iovcnt && n < slot->len; i++) {
+		uint chunk = slot->len - n;
+		if(chunk > iov[i].iov_len) chunk = iov[i].iov_len;
+		memcpy(iov[i].iov_base, slot->data + n, chunk);
+		n += chunk;
+	}
+	*len = n;
+	chan_release(slot, pos + ch->slots, &ch->not_full);
+	return 1;
+}
+
+
+/*
+	The slow path: register on the wait queue, then retry until
+	the attempt is done (the transfer succeeds or the other end is closed).
+ */
+static void chan_wait(wait_queue* q, int (*attempt)(void* arg), void* arg)
+{
+	poll_table pt;
+	poll_table_init(&pt);
+	pt.size = 1;
+	pt.entries = (poll_entry*) xmalloc(sizeof(poll_entry));
+	poll_wait(&pt, q);
+
+	while(1) {
+		__atomic_store_n(&pt.triggered, 0, __ATOMIC_SEQ_CST);
+		if(attempt(arg)) break;
+		poll_table_wait(&pt, -1);
+	}
+	poll_table_release(&pt);
+}
+
+struct chan_transfer {
+	CHANCB* ch;
+	const iovec_t* iov;
+	uint iovcnt;
+	uint size;
+	int len;
+};
+
+/* A send fails (len is -1) once the receive end is closed */
+static int chan_send_attempt(void* arg)
+{
+	struct chan_transfer* t = arg;
+	if(__atomic_load_n(&t->ch->receivers_closed, __ATOMIC_ACQUIRE)) {
+		t->len = -1;
+		return 1;
+	}
+	if(! chan_try_send(t->ch, t->iov, t->iovcnt, t->size)) return 0;
+	t->len = t->size;
+	return 1;
+}
+
+/* 
+	A receive finds end of file (len is 0) once the send end is closed 
+	and the ring is empty. The flag is read first, so that every record 
+	sent before the close is seen by the attempt.
+ */
+static int chan_recv_attempt(void* arg)
+{
+	struct chan_transfer* t = arg;
+	int closed = __atomic_load_n(&t->ch->senders_closed, __ATOMIC_ACQUIRE);
+	if(chan_try_recv(t->ch, t->iov, t->iovcnt, &t->len)) return 1;
+	if(! closed) return 0;
+	t->len = 0;
+	return 1;
+}
+
+
+static int chan_writev(void* this, const iovec_t* iov, uint iovcnt, uint flags)
+{
+	CHANCB* ch = (CHANCB*) this;
+	uint size = 0;
+
+	for(uint i=0; i<iovcnt; i++) {
+		if(iov[i].iov_len > ch->slotsize - size) return -1;
+		size += iov[i].iov_len;
+	}
+	if(size == 0) return 0;
+
+	struct chan_transfer t = { ch, iov, iovcnt, size, 0 };
+	if(! chan_send_attempt(&t)) {
+		if(flags & FID_NONBLOCK) return -1;
+		chan_wait(&ch->not_full, chan_send_attempt, &t);
+	}
+	return t.len;
+}
+
+
+static int chan_readv(void* this, const iovec_t* iov, uint iovcnt, uint flags)
+{
+	CHANCB* ch = (CHANCB*) this;
+
+	struct chan_transfer t = { ch, iov, iovcnt, 0, 0 };
+	if(! chan_recv_attempt(&t)) {
+		if(flags & FID_NONBLOCK) return -1;
+		chan_wait(&ch->not_empty, chan_recv_attempt, &t);
+	}
+	return t.len;
+}
+
+
+static int chan_write(void* this, const char* buf, uint size)
+{
+	iovec_t iov = { (void*) buf, size };
+	return chan_writev(this, &iov, 1, 0);
+}
+
+
+static int chan_read(void* this, char* buf, uint size)
+{
+	iovec_t iov = { buf, size };
+	return chan_readv(this, &iov, 1, 0);
+}
+
+
+static uint chan_receiver_poll(void* this, poll_table* pt)
+{
+	CHANCB* ch = (CHANCB*) this;
+	poll_wait(pt, &ch->not_empty);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint events = 0;
+	if(__atomic_load_n(&ch->senders_closed, __ATOMIC_ACQUIRE))
+		events |= POLL_HANGUP;
+	uint64_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&chan_slot_at(ch, head)->seq, __ATOMIC_ACQUIRE) == head+1)
+		events |= POLL_READ;
+	return events;
+}
+
+
+static uint chan_sender_poll(void* this, poll_table* pt)
+{
+	CHANCB* ch = (CHANCB*) this;
+	poll_wait(pt, &ch->not_full);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&ch->receivers_closed, __ATOMIC_ACQUIRE))
+		return POLL_ERROR;
+	uint64_t tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&chan_slot_at(ch, tail)->seq, __ATOMIC_ACQUIRE) == tail)
+		return POLL_WRITE;
+	return 0;
+}
+
+
+static void chan_free(CHANCB* ch)
+{
+	free(ch->ring);
+	free(ch);
+}
+
+/* 
+	Close an end. Closes are called with kernel_mutex held, so the 
+	second one frees the channel. Otherwise, wake up the other side.
+ */
+static int chan_sender_close(void* this)
+{
+	CHANCB* ch = (CHANCB*) this;
+	__atomic_store_n(&ch->senders_closed, 1, __ATOMIC_RELEASE);
+	if(__atomic_load_n(&ch->receivers_closed, __ATOMIC_ACQUIRE))
+		chan_free(ch);
+	else {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		wait_queue_notify(&ch->not_empty);
+	}
+	return 0;
+}
+
+static int chan_receiver_close(void* this)
+{
+	CHANCB* ch = (CHANCB*) this;
+	__atomic_store_n(&ch->receivers_closed, 1, __ATOMIC_RELEASE);
+	if(__atomic_load_n(&ch->senders_closed, __ATOMIC_ACQUIRE))
+		chan_free(ch);
+	else {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		wait_queue_notify(&ch->not_full);
+	}
+	return 0;
+}
+
+
+int ChanCreate(pipe_t* chan, unsigned int slots, unsigned int slotsize)
+{
+	Fid_t fid[2];
+	FCB* fcb[2];
+
+	if(chan == NULL || slots == 0 || slots > CHAN_MAX_SLOTS || slotsize == 0 || slotsize > CHAN_MAX_SLOTSIZE)
+		return -1;
+
+	uint n = 1;
+	while(n < slots) n <<= 1;
+
+	/* The size is a multiple of the alignment of the indices */
+	CHANCB* ch = (CHANCB*) aligned_alloc(64, sizeof(CHANCB));
+	if(ch == NULL)
+		return -1;
+	ch->head = ch->tail = 0;
+	ch->slots = n;
+	ch->slotsize = slotsize;
+	ch->stride = (sizeof(chan_slot) + slotsize + 7) & ~(size_t)7;
+	ch->ring = (char*) xmalloc(n * ch->stride);
+	for(uint i=0; i<n; i++)
+		chan_slot_at(ch, i)->seq = i;
+	wait_queue_init(&ch->not_empty);
+	wait_queue_init(&ch->not_full);
+	ch->senders_closed = ch->receivers_closed = 0;
+
+	Mutex_Lock(&kernel_mutex);
+	if(! FCB_reserve(2, fid, fcb)) {
+		Mutex_Unlock(&kernel_mutex);
+		chan_free(ch);
+		return -1;
+	}
+	FCB_setup(fcb[0], ch, &ChanReceiverOps);
+	FCB_setup(fcb[1], ch, &ChanSenderOps);
+	Mutex_Unlock(&kernel_mutex);
+
+	chan->read = fid[0];
+	chan->write = fid[1];
+	return 0;
+}
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <string.h>
 #include "kernel_cc.h"
 #include "kernel_dev.h"
 #include "kernel_sched.h"
@@ -66,14 +67,223 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* The size of the kernel RX ring of each terminal */
+#define SERIAL_RX_BUFFER 4096
+
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  Mutex tx_spinlock;      /* writers hold this, not to contend with readers */
+  CondVar tx_ready;
+  uint rx_core;           /* core receiving SERIAL_RX_READY for this device */
+  uint tx_core;           /* core receiving SERIAL_TX_READY for this device */
+
+  /* The RX ring and line discipline, protected by spinlock */
+  uint mode;              /* TERM_CANON | TERM_ECHO */
+  unsigned long rx_head;  /* next byte to store */
+  unsigned long rx_line;  /* end of the data available to readers */
+  unsigned long rx_tail;  /* next byte to read */
+  unsigned long rx_eof;   /* position of a pending end-of-file */
+  int rx_eof_pending;
+  char rx_buffer[SERIAL_RX_BUFFER];
+  uint8_t rx_break[SERIAL_RX_BUFFER/8];  /* ends of lines without a newline */
+
+  wait_queue poll_queue;  /* pollers of input */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
+serial_irq_policy serial_policy = SERIAL_IRQ_FOLLOW;
+
+
+/*
+  Interrupt affinity. 
+
+  Under SERIAL_IRQ_SPREAD and SERIAL_IRQ_FOLLOW, the interrupts of the
+  terminals are initially distributed round-robin over the cores, RX
+  and TX interrupts of a terminal going to different cores when possible.
+  Under SERIAL_IRQ_FOLLOW, a thread that is about to sleep on a terminal
+  also steers the terminal's interrupt to its own core, so that it is
+  woken up by the core it last ran on.
+ */
+
+static void serial_route_irq(serial_dcb_t* dcb, Interrupt intno, uint core)
+{
+  uint* cur = (intno==SERIAL_RX_READY) ? &dcb->rx_core : &dcb->tx_core;
+  if(*cur != core) {
+    *cur = core;
+    bios_serial_interrupt_core(dcb->devno, intno, core);
+  }
+}
+
+static void serial_distribute_irqs()
+{
+  uint ncores = cpu_cores();
+  for(uint i=0; i<bios_serial_ports(); i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    uint rx = 0, tx = 0;
+    if(serial_policy != SERIAL_IRQ_CORE0) {
+      rx = (2*i) % ncores;
+      tx = (2*i+1) % ncores;
+    }
+    serial_route_irq(dcb, SERIAL_RX_READY, rx);
+    serial_route_irq(dcb, SERIAL_TX_READY, tx);
+  }
+}
+
+void serial_set_irq_policy(serial_irq_policy policy)
+{
+  serial_policy = policy;
+  serial_distribute_irqs();
+}
+
+/* Called with the dcb lock held, before sleeping for intno */
+static inline void serial_follow_irq(serial_dcb_t* dcb, Interrupt intno)
+{
+  if(serial_policy == SERIAL_IRQ_FOLLOW)
+    serial_route_irq(dcb, intno, cpu_core_id);
+}
+
+
+
+/*
+  Line discipline.
+
+  Received bytes are moved from the device into the RX ring of the dcb,
+  both by the RX interrupt handler and by readers. In raw mode, every byte
+  in the ring is available to readers. In canonical mode (TERM_CANON),
+  bytes become available only when a line is completed by a newline, 
+  or by SERIAL_EOF (which is not stored, but marks the last byte of the 
+  line in rx_break). Until then, SERIAL_ERASE and
+  SERIAL_DEL remove the last byte of the incomplete line. SERIAL_EOF on an
+  empty line makes the next read return 0. If the ring fills up with an
+  incomplete line, the line is made available as is.
+
+  With TERM_ECHO, accepted bytes (and erasures) are echoed back to the
+  terminal. Echo is best-effort: it is dropped if the console is full.
+
+  All of this is done with the dcb spinlock held.
+ */
+
+#define SERIAL_ERASE '\b'
+#define SERIAL_DEL   0x7f
+#define SERIAL_EOF   0x04
+
+static inline void serial_echo(serial_dcb_t* dcb, const char* buf, uint size)
+{
+  if(dcb->mode & TERM_ECHO)
+    bios_write_serial_n(dcb->devno, buf, size);
+}
+
+static inline int serial_rx_break(serial_dcb_t* dcb, uint pos)
+{
+  return dcb->rx_break[pos/8] & (1u << (pos%8));
+}
+
+static inline void serial_rx_set_break(serial_dcb_t* dcb, uint pos, int on)
+{
+  if(on)
+    dcb->rx_break[pos/8] |= (1u << (pos%8));
+  else
+    dcb->rx_break[pos/8] &= ~(1u << (pos%8));
+}
+
+/* Apply the line discipline to the bytes in [from, rx_head) of the ring */
+static void serial_cook(serial_dcb_t* dcb, unsigned long from)
+{
+  unsigned long to = from;    /* erasures compact the ring in place */
+
+  for(unsigned long i=from; i<dcb->rx_head; i++) {
+    char c = dcb->rx_buffer[i % SERIAL_RX_BUFFER];
+
+    if(c==SERIAL_ERASE || c==SERIAL_DEL) {
+      if(to > dcb->rx_line) {
+        to--;
+        serial_echo(dcb, "\b \b", 3);
+      }
+    }
+    else if(c==SERIAL_EOF) {
+      if(to==dcb->rx_line && !dcb->rx_eof_pending) {
+        dcb->rx_eof = to;
+        dcb->rx_eof_pending = 1;
+      }
+      if(to > dcb->rx_line)
+        serial_rx_set_break(dcb, (to-1) % SERIAL_RX_BUFFER, 1);
+      dcb->rx_line = to;
+    }
+    else {
+      dcb->rx_buffer[to++ % SERIAL_RX_BUFFER] = c;
+      serial_echo(dcb, &c, 1);
+      if(c=='\n') dcb->rx_line = to;
+    }
+  }
+
+  dcb->rx_head = to;
+  if(dcb->rx_head - dcb->rx_tail == SERIAL_RX_BUFFER)
+    dcb->rx_line = dcb->rx_head;
+}
+
+/* Move received bytes from the device into the RX ring */
+static void serial_rx_fill(serial_dcb_t* dcb)
+{
+  while(1) {
+    unsigned long space = SERIAL_RX_BUFFER - (dcb->rx_head - dcb->rx_tail);
+    if(space==0) break;
+
+    uint pos = dcb->rx_head % SERIAL_RX_BUFFER;
+    uint len = (space < SERIAL_RX_BUFFER - pos) ? space : SERIAL_RX_BUFFER - pos;
+    uint n = bios_read_serial_n(dcb->devno, dcb->rx_buffer+pos, len);
+    if(n==0) break;
+
+    unsigned long from = dcb->rx_head;
+    dcb->rx_head += n;
+    if(dcb->mode & TERM_CANON)
+      serial_cook(dcb, from);
+    else {
+      serial_echo(dcb, dcb->rx_buffer+pos, n);
+      dcb->rx_line = dcb->rx_head;
+    }
+  }
+}
+
+/* The number of bytes a reader may take from the RX ring */
+static inline unsigned long serial_rx_available(serial_dcb_t* dcb)
+{
+  unsigned long end = dcb->rx_eof_pending ? dcb->rx_eof : dcb->rx_line;
+  return end - dcb->rx_tail;
+}
+
+/* Copy out of the RX ring; in canonical mode, stop at the end of a line */
+static uint serial_rx_copy(serial_dcb_t* dcb, char* buf, uint size)
+{
+  uint count = 0;
+  while(count < size) {
+    uint pos = dcb->rx_tail % SERIAL_RX_BUFFER;
+    uint len = size - count;
+    if(len > SERIAL_RX_BUFFER - pos) len = SERIAL_RX_BUFFER - pos;
+
+    if(dcb->mode & TERM_CANON) {
+      /* A line ends at a newline, or where SERIAL_EOF completed it */
+      uint i;
+      int eol = 0;
+      for(i=0; i<len && !eol; i++)
+        eol = (dcb->rx_buffer[pos+i]=='\n') || serial_rx_break(dcb, pos+i);
+      len = i;
+      if(eol) serial_rx_set_break(dcb, pos+len-1, 0);
+      memcpy(buf+count, dcb->rx_buffer+pos, len);
+      count += len;
+      dcb->rx_tail += len;
+      if(eol) break;
+    }
+    else {
+      memcpy(buf+count, dcb->rx_buffer+pos, len);
+      count += len;
+      dcb->rx_tail += len;
+    }
+  }
+  return count;
+}
 
 
 /*
@@ -84,48 +294,63 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
+  /* Drain only the terminals which are ready */
+  serial_mask_t ready = bios_serial_pending(SERIAL_RX_READY);
+  while(ready) {
+    int i = __builtin_ctzll(ready);
+    ready &= ready-1;
+
     serial_dcb_t* dcb = &serial_dcb[i];
     Mutex_Lock(& dcb->spinlock);
-    Cond_Broadcast(&dcb->rx_ready);
+    serial_rx_fill(dcb);
+    /* Wake up readers only when there is something for them */
+    if(serial_rx_available(dcb) > 0 || dcb->rx_eof_pending) {
+      Cond_Broadcast(&dcb->rx_ready);
+      wait_queue_notify(&dcb->poll_queue);
+    }
     Mutex_Unlock(& dcb->spinlock);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device, sleeping if needed, unless FID_NONBLOCK is set.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+static int serial_read_flags(void* dev, char *buf, unsigned int size, uint flags)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
   Mutex_Lock(& dcb->spinlock);
 
-  uint count =  0;
+  int count =  0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
+  while(size>0) {
+    /* Raw, unechoed input with nothing buffered bypasses the ring */
+    if(dcb->mode == TERM_RAW && dcb->rx_head == dcb->rx_tail) {
+      count = bios_read_serial_n(dcb->devno, buf, size);
+      if(count>0) break;
     }
-    else if(count==0) {
-			//fprintf(stderr,"\nLALALALALALLA\n");
-		//if (lock!=&CURTHREAD->state_spinlock)    /* EDITED: set yield cause to priority inversion*/
-			setTerminationType(3);
-		//spin=MUTEX_SPINS; 
-    //yield();
-			
-      Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+    else {
+      serial_rx_fill(dcb);
+      unsigned long avail = serial_rx_available(dcb);
+      if(avail > 0) {
+        count = serial_rx_copy(dcb, buf, (avail < size) ? avail : size);
+        break;
+      }
+      if(dcb->rx_eof_pending) {
+        dcb->rx_eof_pending = 0;   /* count==0 reports the end of file */
+        break;
+      }
     }
-    else
+
+    if(flags & FID_NONBLOCK) {
+      count = -1;
       break;
+    }
+    setTerminationType(3);
+    serial_follow_irq(dcb, SERIAL_RX_READY);
+    Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
   }
 
   Mutex_Unlock(& dcb->spinlock);
@@ -134,40 +359,98 @@ int serial_read(void* dev, char *buf, unsigned int size)
   return count;
 }
 
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  return serial_read_flags(dev, buf, size, 0);
+}
+
+/* Only the first non-empty segment is filled, as a terminal read may block */
+int serial_readv(void* dev, const iovec_t* iov, unsigned int iovcnt, unsigned int flags)
+{
+  for(uint i=0; i<iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      return serial_read_flags(dev, iov[i].iov_base, iov[i].iov_len, flags);
+  return 0;
+}
+
 
 /*
-  A polling driver for serial writes
-  */
+  Input is ready when a read would return at once. Output is always 
+  considered ready, a writer only waits for the device to drain.
+ */
+unsigned int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  unsigned int events = POLL_WRITE;
+
+  poll_wait(pt, &dcb->poll_queue);
+
+  int pre = preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+  serial_rx_fill(dcb);
+  if(serial_rx_available(dcb) > 0 || dcb->rx_eof_pending)
+    events |= POLL_READ;
+  else if(pt)
+    serial_follow_irq(dcb, SERIAL_RX_READY);
+  Mutex_Unlock(& dcb->spinlock);
+  if(pre) preempt_on;
+
+  return events;
+}
+
+
+/*
+  Interrupt-driven driver for serial-device writes.
+
+  The transmit buffer of each terminal is the console buffer of the bios.
+  When it is full, writers sleep on tx_ready, until the device drains
+  some of it and raises SERIAL_TX_READY.
+ */
 
-/* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  serial_mask_t ready = bios_serial_pending(SERIAL_TX_READY);
+  while(ready) {
+    int i = __builtin_ctzll(ready);
+    ready &= ready-1;
+
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(& dcb->tx_spinlock);
+    Cond_Broadcast(&dcb->tx_ready);
+    Mutex_Unlock(& dcb->tx_spinlock);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write to the device, sleeping if needed.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(& dcb->tx_spinlock);
+
   unsigned int count = 0;
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+    unsigned int n = bios_write_serial_n(dcb->devno, buf+count, size-count);
 
-    if(success) {
-      count++;
+    if(n>0) {
+      count += n;
     } 
-    else if(count==0)
-    {
-      yield();
+    else {
+      setTerminationType(3);
+      serial_follow_irq(dcb, SERIAL_TX_READY);
+      Cond_Wait(&dcb->tx_spinlock, &dcb->tx_ready);
     }
-    else
-      break;
   }
 
+  Mutex_Unlock(& dcb->tx_spinlock);
+  preempt_on;           /* Restart preemption */
+
   return count;  
 }
 
@@ -190,7 +473,9 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .ReadV = serial_readv,
+  .Poll = serial_poll
 };
 
 
@@ -221,8 +506,24 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_ready = COND_INIT;
+    serial_dcb[i].tx_spinlock = MUTEX_INIT;
+    serial_dcb[i].rx_core = 0;
+    serial_dcb[i].tx_core = 0;
+    serial_dcb[i].mode = TERM_RAW;
+    serial_dcb[i].rx_head = serial_dcb[i].rx_line = serial_dcb[i].rx_tail = 0;
+    serial_dcb[i].rx_eof = 0;
+    serial_dcb[i].rx_eof_pending = 0;
+    memset(serial_dcb[i].rx_break, 0, sizeof(serial_dcb[i].rx_break));
+    wait_queue_init(&serial_dcb[i].poll_queue);
   }
 
+  serial_distribute_irqs();
+}
+
+
+void initialize_device_interrupts()
+{
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
 }
@@ -243,4 +544,32 @@ uint device_no(Device_type major)
   return devtable[major].devnum;
 }
 
+int is_serial_stream(file_ops* ops)
+{
+  return ops == &devtable[DEV_SERIAL].dev_fops;
+}
+
+int serial_set_mode(file_ops* ops, void* dev, uint mode)
+{
+  if(! is_serial_stream(ops) || (mode & ~TERM_COOKED))
+    return -1;
+
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+
+  /* Whatever is buffered becomes available to readers */
+  dcb->mode = mode;
+  dcb->rx_line = dcb->rx_head;
+  if(! (mode & TERM_CANON))   /* raw reads ignore the line ends */
+    memset(dcb->rx_break, 0, sizeof(dcb->rx_break));
+  Cond_Broadcast(&dcb->rx_ready);
+
+  Mutex_Unlock(& dcb->spinlock);
+  preempt_on;
+
+  return 0;
+}
+
 
@@ -9,6 +9,8 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
+#include "kernel_poll.h"
 
 /**
   @file kernel_dev.h
@@ -92,6 +94,42 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+  /** @brief Vectored read operation (optional).
+
+    Read into the 'iovcnt' segments of 'iov', in order, as if they were
+    a single buffer, with the semantics of Read. 
+    If 'flags' contains FID_NONBLOCK, return -1 instead of blocking.
+    If NULL, ReadV calls Read on the first non-empty segment.
+
+    Streams on which a read may block should implement this method,
+    so that non-blocking reads never block. Other streams are polled
+    before a non-blocking Read.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt, unsigned int flags);
+
+  /** @brief Vectored write operation (optional).
+
+    Write from the 'iovcnt' segments of 'iov', in order, as if they were
+    a single buffer, with the semantics of Write.
+    If 'flags' contains FID_NONBLOCK, return -1 instead of blocking.
+    If NULL, WriteV calls Write on each segment, until one is not 
+    written completely.
+
+    As for ReadV, streams on which a write may block should implement
+    this method.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt, unsigned int flags);
+
+  /** @brief Poll operation (optional).
+
+    Return the events (@c POLL_READ, @c POLL_WRITE, @c POLL_HANGUP, @c POLL_ERROR) 
+    currently ready on the stream. If 'pt' is not NULL, first register it
+    on the wait queue(s) of the stream with @c poll_wait; at most two
+    registrations are allowed.
+    If NULL, the stream is always ready.
+  */
+    unsigned int (*Poll)(void* this, poll_table* pt);
 } file_ops;
 
 
@@ -134,6 +172,37 @@ typedef struct device_control_block
 void initialize_devices();
 
 
+/** 
+  @brief Install the device interrupt handlers.
+
+  Device interrupts may be routed to any core, therefore this
+  function is called at kernel startup by every core.
+ */
+void initialize_device_interrupts();
+
+
+/**
+  @brief Serial interrupt affinity policy.
+
+  This determines which core receives the interrupts of each serial device.
+*/
+typedef enum {
+  SERIAL_IRQ_CORE0,   /**< All serial interrupts go to core 0 */
+  SERIAL_IRQ_SPREAD,  /**< Serial interrupts are spread round-robin over the cores */
+  SERIAL_IRQ_FOLLOW   /**< Like @c SERIAL_IRQ_SPREAD, but a thread blocking on a 
+                           terminal steers the terminal's interrupt to its own core */
+} serial_irq_policy;
+
+
+/**
+  @brief Set the serial interrupt affinity policy.
+
+  The default policy is @c SERIAL_IRQ_FOLLOW. 
+  Setting the policy re-distributes the interrupts of all serial devices.
+*/
+void serial_set_irq_policy(serial_irq_policy policy);
+
+
 /**
   @brief Open a device.
 
@@ -153,6 +222,24 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Check if a stream is a serial device.
+
+  The stream is given by its @c file_ops record.
+  */
+int is_serial_stream(file_ops* ops);
+
+/**
+  @brief Set the line discipline of a serial device stream.
+
+  The stream is given by its @c file_ops record and stream object, 
+  as returned by @c device_open. 
+
+  It returns 0 on success and -1 if the stream is not a serial device,
+  or @c mode is not a combination of @c TERM_CANON and @c TERM_ECHO.
+  */
+int serial_set_mode(file_ops* ops, void* dev, uint mode);
+
 /** @} */
 
 #endif
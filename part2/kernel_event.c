@@ -0,0 +1,409 @@
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_slab.h"
+
+/*
+	Event queues.
+
+	Each stream of interest is an event_item, which registers its own
+	poll table on the wait queues of the stream. When a stream notifies
+	its wait queue, the item is moved to the ready list of the event queue,
+	and the waiters of the event queue are woken up. EventWait only polls
+	the items on the ready list, and puts back the ones still ready.
+
+	The ready list is protected by the spinlock, which is taken with
+	preemption off, under the locks of the wait queues. Therefore,
+	streams are never polled with the spinlock held. Instead, the
+	ctl_lock serializes EventCtl and the scans of EventWait, so that
+	items are not removed while they are being polled.
+
+	An item is keyed by its file id and FCB, and holds a reference to 
+	the FCB. It is also on the watchers list of the FCB, so that closing
+	the file id can find it. The close holds kernel_mutex, which is taken
+	after ctl_lock, so it only marks the item closed and puts it on the
+	ready list; the next scan (or EventCtl) drops it.
+	The lock order is: ctl_lock, kernel_mutex, spinlock.
+ */
+
+/* The states of an item, with respect to the ready list */
+enum { ITEM_IDLE, ITEM_READY, ITEM_SCANNED, ITEM_RENOTIFIED };
+
+typedef struct event_item {
+	poll_table pt;			/* first, so that notify finds the item */
+	struct event_control_block* ecb;
+	FCB* fcb;
+	Fid_t fid;
+	struct process_control_block* owner;	/* the process of fid */
+	uint events;
+	rlnode interest_node;
+	rlnode ready_node;
+	rlnode watch_node;		/* in fcb->watchers, under kernel_mutex */
+	int state;
+	int closed;				/* fid was closed, set under the spinlock */
+} event_item;
+
+typedef struct event_control_block {
+	Mutex ctl_lock;
+	Mutex lock;
+	rlnode interest;
+	rlnode ready;
+	poll_table waiter;		/* EventWait sleeps here */
+} ECB;
+
+static kmem_cache ecb_cache = KMEM_CACHE_INIT("ECB", ECB);
+static kmem_cache event_item_cache = KMEM_CACHE_INIT("event_item", event_item);
+
+static int event_close(void* this);
+
+file_ops EventOps = {
+	.Open = NULL,
+	.Close = event_close
+};
+
+
+/* 
+	Put an item on the ready list, called with ecb->lock held. 
+	An item which is being scanned is only marked, and the scan
+	will put it back on the list.
+	Returns true if the item was not already on its way to the list.
+ */
+static int event_ready_push(ECB* ecb, event_item* item)
+{
+	switch(item->state) {
+	case ITEM_IDLE:
+		item->state = ITEM_READY;
+		rlist_push_back(&ecb->ready, &item->ready_node);
+		return 1;
+	case ITEM_SCANNED:
+		item->state = ITEM_RENOTIFIED;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* The notify callback of the items, called by the wait queues */
+static void event_notify(poll_table* pt)
+{
+	event_item* item = (event_item*) pt;
+	ECB* ecb = item->ecb;
+
+	int pre = preempt_off;
+	Mutex_Lock(&ecb->lock);
+	int wake = event_ready_push(ecb, item);
+	Mutex_Unlock(&ecb->lock);
+
+	if(wake)
+		poll_table_trigger(&ecb->waiter);
+	if(pre) preempt_on;
+}
+
+
+void event_fid_closed(struct process_control_block* pcb, Fid_t fid, FCB* fcb)
+{
+	rlnode* p = fcb->watchers.next;
+	while(p != &fcb->watchers) {
+		event_item* item = (event_item*) p->obj;
+		p = p->next;
+		if(item->owner != pcb || item->fid != fid) continue;
+
+		rlist_remove(&item->watch_node);
+
+		ECB* ecb = item->ecb;
+		int pre = preempt_off;
+		Mutex_Lock(&ecb->lock);
+		__atomic_store_n(&item->closed, 1, __ATOMIC_RELEASE);
+		int wake = event_ready_push(ecb, item);
+		Mutex_Unlock(&ecb->lock);
+		if(wake)
+			poll_table_trigger(&ecb->waiter);
+		if(pre) preempt_on;
+	}
+}
+
+/* Unregister the item from its stream, and take it off the lists */
+static void event_detach(ECB* ecb, event_item* item)
+{
+	/* After this, no notification can be in progress */
+	poll_table_release(&item->pt);
+
+	int pre = preempt_off;
+	Mutex_Lock(&ecb->lock);
+	if(item->state == ITEM_READY) rlist_remove(&item->ready_node);
+	Mutex_Unlock(&ecb->lock);
+	if(pre) preempt_on;
+
+	rlist_remove(&item->interest_node);
+}
+
+/* Detach an item and release its stream, called with ctl_lock held */
+static void event_drop(ECB* ecb, event_item* item)
+{
+	event_detach(ecb, item);
+	Mutex_Lock(&kernel_mutex);
+	rlist_remove(&item->watch_node);
+	FCB_decref(item->fcb);      /* the reference of the item */
+	Mutex_Unlock(&kernel_mutex);
+	kmem_cache_free(&event_item_cache, item);
+}
+
+/* 
+	Find the item of a stream, called with ctl_lock held.
+	Items whose file id was closed are dropped on the way.
+ */
+static event_item* event_find(ECB* ecb, Fid_t fid, FCB* fcb)
+{
+	event_item* found = NULL;
+	rlnode* p = ecb->interest.next;
+	while(p != &ecb->interest) {
+		event_item* item = (event_item*) p->obj;
+		p = p->next;
+		if(__atomic_load_n(&item->closed, __ATOMIC_ACQUIRE))
+			event_drop(ecb, item);
+		else if(item->fid == fid && item->fcb == fcb)
+			found = item;
+	}
+	return found;
+}
+
+
+static int event_close(void* this)
+{
+	ECB* ecb = (ECB*) this;
+
+	/* Called from FCB_decref, with kernel_mutex held */
+	while(! is_rlist_empty(&ecb->interest)) {
+		event_item* item = (event_item*) ecb->interest.next->obj;
+		event_detach(ecb, item);
+		rlist_remove(&item->watch_node);
+		FCB_decref(item->fcb);
+		kmem_cache_free(&event_item_cache, item);
+	}
+	kmem_cache_free(&ecb_cache, ecb);
+	return 0;
+}
+
+
+Fid_t EventCreate()
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	Mutex_Lock(&kernel_mutex);
+	if(! FCB_reserve(1, &fid, &fcb)) {
+		Mutex_Unlock(&kernel_mutex);
+		return NOFILE;
+	}
+
+	ECB* ecb = (ECB*) kmem_cache_alloc(&ecb_cache);
+	ecb->ctl_lock = MUTEX_INIT;
+	ecb->lock = MUTEX_INIT;
+	rlnode_init(&ecb->interest, NULL);
+	rlnode_init(&ecb->ready, NULL);
+	poll_table_init(&ecb->waiter);
+
+	FCB_setup(fcb, ecb, &EventOps);
+	Mutex_Unlock(&kernel_mutex);
+	return fid;
+}
+
+
+/* The event queue of efid, pinned, or NULL. Called with kernel_mutex held. */
+static FCB* get_event_fcb(Fid_t efid)
+{
+	FCB* efcb = get_fcb(efid);
+	if(efcb == NULL || efcb->streamfunc != &EventOps)
+		return NULL;
+	FCB_incref(efcb);
+	return efcb;
+}
+
+
+int EventCtl(Fid_t efid, int op, Fid_t fid, unsigned int events)
+{
+	int retcode = -1;
+	FCB* drop = NULL;
+
+	if(op < EVENT_ADD || op > EVENT_DEL) return -1;
+	events &= POLL_READ|POLL_WRITE;
+
+	Mutex_Lock(&kernel_mutex);
+	FCB* efcb = get_event_fcb(efid);
+	FCB* fcb = get_fcb(fid);
+	if(efcb == NULL || fcb == NULL || fcb->streamfunc == &EventOps) {
+		if(efcb) FCB_decref(efcb);
+		Mutex_Unlock(&kernel_mutex);
+		return -1;
+	}
+	/* The item will hold this reference */
+	FCB_incref(fcb);
+	Mutex_Unlock(&kernel_mutex);
+
+	ECB* ecb = (ECB*) efcb->streamobj;
+	Mutex_Lock(&ecb->ctl_lock);
+
+	event_item* item = event_find(ecb, fid, fcb);
+	switch(op) {
+	case EVENT_ADD:
+		if(item) { drop = fcb; break; }
+
+		item = (event_item*) kmem_cache_alloc(&event_item_cache);
+		poll_table_init(&item->pt);
+		item->pt.size = 2;
+		item->pt.entries = (poll_entry*) xmalloc(2*sizeof(poll_entry));
+		item->pt.notify = event_notify;
+		item->ecb = ecb;
+		item->fcb = fcb;
+		item->fid = fid;
+		item->owner = CURPROC;
+		item->events = events;
+		item->state = ITEM_IDLE;
+		item->closed = 0;
+		rlnode_init(&item->interest_node, item);
+		rlnode_init(&item->ready_node, item);
+		rlnode_init(&item->watch_node, item);
+		rlist_push_back(&ecb->interest, &item->interest_node);
+
+		/* Watch the fid, unless it was closed meanwhile */
+		Mutex_Lock(&kernel_mutex);
+		if(get_fcb(fid) == fcb)
+			rlist_push_back(&fcb->watchers, &item->watch_node);
+		else
+			item->closed = 1;
+		Mutex_Unlock(&kernel_mutex);
+		if(item->closed) {
+			event_drop(ecb, item);
+			break;
+		}
+
+		/* Register, and catch up with the current state */
+		if(stream_poll(fcb, &item->pt) & (events|POLL_HANGUP|POLL_ERROR))
+			event_notify(&item->pt);
+		retcode = 0;
+		break;
+
+	case EVENT_MOD:
+		drop = fcb;
+		if(item == NULL) break;
+		item->events = events;
+		/* The new events may be ready already */
+		event_notify(&item->pt);
+		retcode = 0;
+		break;
+
+	case EVENT_DEL:
+		drop = fcb;
+		if(item == NULL) break;
+		event_drop(ecb, item);
+		retcode = 0;
+		break;
+	}
+
+	Mutex_Unlock(&ecb->ctl_lock);
+
+	Mutex_Lock(&kernel_mutex);
+	if(drop) FCB_decref(drop);
+	FCB_decref(efcb);
+	Mutex_Unlock(&kernel_mutex);
+	return retcode;
+}
+
+
+/*
+	Poll the items of the ready list, storing up to n ready streams.
+	Ready items stay on the ready list, to be reported again.
+ */
+static uint event_scan(ECB* ecb, event_t* evs, uint n)
+{
+	rlnode pending;
+	rlnode_init(&pending, NULL);
+
+	Mutex_Lock(&ecb->ctl_lock);
+
+	int pre = preempt_off;
+	Mutex_Lock(&ecb->lock);
+	__atomic_store_n(&ecb->waiter.triggered, 0, __ATOMIC_SEQ_CST);
+	rlist_append(&pending, &ecb->ready);
+	for(rlnode* p = pending.next; p != &pending; p = p->next)
+		((event_item*)p->obj)->state = ITEM_SCANNED;
+	Mutex_Unlock(&ecb->lock);
+	if(pre) preempt_on;
+
+	uint count = 0;
+	rlnode scanned, keep;
+	rlnode_init(&scanned, NULL);
+	rlnode_init(&keep, NULL);
+	while(count < n && ! is_rlist_empty(&pending)) {
+		event_item* item = (event_item*) rlist_pop_front(&pending)->obj;
+		if(__atomic_load_n(&item->closed, __ATOMIC_ACQUIRE)) {
+			event_drop(ecb, item);
+			continue;
+		}
+		uint ev = stream_poll(item->fcb, NULL) & (item->events|POLL_HANGUP|POLL_ERROR);
+		if(ev) {
+			evs[count].fid = item->fid;
+			evs[count].events = ev;
+			count++;
+			rlist_push_back(&keep, &item->ready_node);
+		}
+		else
+			rlist_push_back(&scanned, &item->ready_node);
+	}
+	/* The items not polled are still pending */
+	rlist_append(&keep, &pending);
+
+	pre = preempt_off;
+	Mutex_Lock(&ecb->lock);
+	while(! is_rlist_empty(&keep)) {
+		event_item* item = (event_item*) rlist_pop_front(&keep)->obj;
+		item->state = ITEM_IDLE;
+		event_ready_push(ecb, item);
+	}
+	/* Items which were not ready, unless notified meanwhile */
+	while(! is_rlist_empty(&scanned)) {
+		event_item* item = (event_item*) rlist_pop_front(&scanned)->obj;
+		int renotified = (item->state == ITEM_RENOTIFIED);
+		item->state = ITEM_IDLE;
+		if(renotified) event_ready_push(ecb, item);
+	}
+	Mutex_Unlock(&ecb->lock);
+	if(pre) preempt_on;
+
+	Mutex_Unlock(&ecb->ctl_lock);
+	return count;
+}
+
+
+int EventWait(Fid_t efid, event_t* evs, unsigned int n, timeout_t timeout)
+{
+	if(evs == NULL || n == 0) return -1;
+
+	Mutex_Lock(&kernel_mutex);
+	FCB* efcb = get_event_fcb(efid);
+	Mutex_Unlock(&kernel_mutex);
+	if(efcb == NULL) return -1;
+
+	ECB* ecb = (ECB*) efcb->streamobj;
+	long deadline = (timeout > 0) ? poll_clock_ms() + timeout : 0;
+	uint count;
+	while(1) {
+		count = event_scan(ecb, evs, n);
+		if(count > 0 || timeout == 0) break;
+
+		timeout_t left = -1;
+		if(timeout > 0) {
+			left = deadline - poll_clock_ms();
+			if(left <= 0) break;
+		}
+		if(! poll_table_wait(&ecb->waiter, left)) break;
+	}
+
+	Mutex_Lock(&kernel_mutex);
+	FCB_decref(efcb);
+	Mutex_Unlock(&kernel_mutex);
+	return count;
+}
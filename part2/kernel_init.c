@@ -48,6 +48,9 @@ void boot_tinyos_kernel()
 
   cpu_core_barrier_sync();
 
+  /* Device interrupts may be sent to any core */
+  initialize_device_interrupts();
+
 #ifndef NVALGRIND
   VALGRIND_PRINTF_BACKTRACE("TINYOS: Entering scheduler for core %d\n",cpu_core_id);
 #endif
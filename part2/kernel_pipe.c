@@ -3,21 +3,48 @@
 #include "util.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_slab.h"
+
+/* Pipe control blocks and buffer pages are recycled through object caches */
+static kmem_cache picb_cache = KMEM_CACHE_INIT("PICB", PICB);
+static kmem_cache pipe_page_cache = KMEM_CACHE_INIT("pipe_page", pipe_page);
+
 file_ops ReaderOps = {
 	.Open = NULL,
 	.Write = pipe_illegal_call_reader,
 	.Read =  pipe_read,
-	.Close = pipe_close	
+	.Close = pipe_reader_close,
+	.ReadV = pipe_readv,
+	.Poll = pipe_reader_poll
 	};
 file_ops WriterOps = {
 	.Open = NULL,
 	.Read = pipe_illegal_call_writer,
 	.Write =  pipe_write,
-	.Close = pipe_close	
+	.Close = pipe_writer_close,
+	.WriteV = pipe_writev,
+	.Poll = pipe_writer_poll
 	};
 int Pipe(pipe_t* pipe)
 {
+	return PipeEx(pipe, PIPE_STREAM);
+}
+
+int PipeEx(pipe_t* pipe, unsigned int flags)
+{
+	if(flags & ~PIPE_MESSAGE)
+		return -1;
+
 	Mutex_Lock(&kernel_mutex);
+	int retcode = pipe_create(pipe, flags);
+	Mutex_Unlock(&kernel_mutex);
+	return retcode;
+}
+
+/* Create a pipe, called with kernel_mutex held */
+int pipe_create(pipe_t* pipe, uint flags)
+{
 	PICB* myPipe = NULL;
 	Fid_t myArray[2];
 	//myArray[0] = pipe->read;
@@ -28,28 +55,33 @@ int Pipe(pipe_t* pipe)
 	int check = FCB_reserve(2, myArray,myFCBs);
 		
 	if(!check)
-	{
-		Mutex_Unlock(&kernel_mutex);
-		return -1;      
-	}	 
+		return -1;
 
-	myPipe = (PICB*)xmalloc(sizeof(PICB));
-	myPipe->buffer = (io_buffer*)xmalloc(sizeof(io_buffer));
-	io_buffer_init(myPipe->buffer);
+	myPipe = (PICB*)kmem_cache_alloc(&picb_cache);
+	myPipe->head = myPipe->tail = myPipe->spare = NULL;
+	myPipe->rpos = myPipe->wpos = 0;
+	myPipe->data = 0;
+	myPipe->limit = PIPE_DEFAULT_LIMIT;
+	myPipe->flags = flags;
+	myPipe->writers_waiting = 0;
 
-	myFCBs[0]-> streamobj = myPipe;
-	myFCBs[1]-> streamobj = myPipe;
-	myFCBs[0] ->streamfunc = &ReaderOps;
-	myFCBs[1]->streamfunc = &WriterOps;
 	myPipe->read = myFCBs[0];
 	myPipe->write = myFCBs[1];
-	myPipe->reader_pointer = 0;
-	myPipe->writer_pointer = 0;
+	myPipe->reader_lock = MUTEX_INIT;
+	myPipe->writer_lock = MUTEX_INIT;
+	myPipe->wait_lock = MUTEX_INIT;
+	myPipe->reader_closed = 0;
+	myPipe->writer_closed = 0;
+	myPipe->low_mark = 1;
+	myPipe->pending_since = 0;
+	myPipe->high_mark = PIPE_DEFAULT_LIMIT-1;
 	myPipe->reader_var = COND_INIT;
 	myPipe->writer_var = COND_INIT;
+	wait_queue_init(&myPipe->poll_queue);
+	FCB_setup(myFCBs[0], myPipe, &ReaderOps);
+	FCB_setup(myFCBs[1], myPipe, &WriterOps);
 	pipe->read = myArray[0];
 	pipe->write = myArray[1];
-	Mutex_Unlock(&kernel_mutex);
 	return 0;
 }
 
@@ -64,53 +96,661 @@ int pipe_illegal_call_reader(void* this,char* buf,uint size){
 int pipe_illegal_call_writer(void* this,const char* buf,uint size){
 	return -1;
 }
-int pipe_close(void* pipecb){
-	PICB * pipe = (PICB*)pipecb;
-	//reader and writer refcount 0 --> then close;	
-	if(pipe->read->refcount ==0 && pipe->write->refcount ==0){
-		release_FCB(pipe->read);
-		release_FCB(pipe->write);
-		free(pipe);	
+/*
+	Wake up the threads sleeping on cv, and the pollers. This is only 
+	called on the transitions that a sleeper may be waiting for, which 
+	are also the transitions of the poll events.
+ */
+static void pipe_wakeup(PICB* pipe, CondVar* cv)
+{
+	int pre = preempt_off;
+	Mutex_Lock(&pipe->wait_lock);
+	Cond_Broadcast(cv);
+	Mutex_Unlock(&pipe->wait_lock);
+	wait_queue_notify(&pipe->poll_queue);
+	if(pre) preempt_on;
+}
+
+static inline uint pipe_data(PICB* pipe)
+{
+	return __atomic_load_n(&pipe->data, __ATOMIC_ACQUIRE);
+}
+
+static inline uint pipe_space(PICB* pipe)
+{
+	uint data = pipe_data(pipe);
+	return (data < pipe->limit) ? pipe->limit - data : 0;
+}
+
+/* 
+	Readers wait for low_mark bytes of data, but for no more than
+	PIPE_LOW_MARK_DELAY after data arrives, so that a writer which 
+	stops below the low mark does not stall them.
+ */
+static int pipe_reader_blocked(PICB* pipe)
+{
+	uint data = pipe_data(pipe);
+	if(data >= pipe->low_mark) return 0;
+	if(data == 0) return 1;
+	long since = __atomic_load_n(&pipe->pending_since, __ATOMIC_RELAXED);
+	return poll_clock_ms() - since < PIPE_LOW_MARK_DELAY;
+}
+
+static int pipe_empty(PICB* pipe)
+{
+	return pipe_data(pipe) == 0;
+}
+
+/* Writers wait for the data to drain to high_mark */
+static int pipe_writer_blocked(PICB* pipe)
+{
+	return pipe_data(pipe) > pipe->high_mark;
+}
+
+/*
+	Sleep on cv while blocked and the other end is open. 
+	The condition is re-checked under wait_lock, and the other side wakes us 
+	under wait_lock after changing it, so no wakeup is lost.
+ */
+static void pipe_sleep(PICB* pipe, CondVar* cv, int (*blocked)(PICB*), int* closed)
+{
+	int pre = preempt_off;
+	Mutex_Lock(&pipe->wait_lock);
+	while(blocked(pipe) && ! __atomic_load_n(closed, __ATOMIC_ACQUIRE)) {
+		setTerminationType(3);
+		Cond_Wait(&pipe->wait_lock, cv);
+	}
+	Mutex_Unlock(&pipe->wait_lock);
+	if(pre) preempt_on;
+}
+
+static void pipe_free(PICB* pipe)
+{
+	while(pipe->head) {
+		pipe_page* next = pipe->head->next;
+		kmem_cache_free(&pipe_page_cache, pipe->head);
+		pipe->head = next;
 	}
+	kmem_cache_free(&pipe_page_cache, pipe->spare);
+	kmem_cache_free(&picb_cache, pipe);
+}
+
+int pipe_reader_close(void* pipecb){
+	PICB * pipe = (PICB*)pipecb;
+	__atomic_store_n(&pipe->reader_closed, 1, __ATOMIC_RELEASE);
+	if(__atomic_load_n(&pipe->writer_closed, __ATOMIC_ACQUIRE))
+		pipe_free(pipe);
+	else
+		pipe_wakeup(pipe, &pipe->writer_var);
 	return 0;
 }
 
-int pipe_read(void* pipecb, char* buf, uint size){
-	int ret;
-	PICB * pipe = (PICB*)pipecb;	
-	if(pipe->write->refcount ==0)
-	{
-		if(isEmpty(pipe->buffer)){
-			pipe->read->refcount =0;
-			return 0;
+int pipe_writer_close(void* pipecb){
+	PICB * pipe = (PICB*)pipecb;
+	__atomic_store_n(&pipe->writer_closed, 1, __ATOMIC_RELEASE);
+	if(__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE))
+		pipe_free(pipe);
+	else
+		pipe_wakeup(pipe, &pipe->reader_var);
+	return 0;
+}
+
+/*
+	Page management. The reader hands one consumed page back to the writer 
+	through the spare slot, so that a steady stream does not allocate;
+	any other consumed page goes back to the page cache, so the buffer 
+	shrinks as it drains.
+ */
+static pipe_page* pipe_page_get(PICB* pipe)
+{
+	pipe_page* page = __atomic_exchange_n(&pipe->spare, NULL, __ATOMIC_ACQ_REL);
+	if(page==NULL)
+		page = (pipe_page*)kmem_cache_alloc(&pipe_page_cache);
+	page->next = NULL;
+	return page;
+}
+
+static void pipe_page_put(PICB* pipe, pipe_page* page)
+{
+	page = __atomic_exchange_n(&pipe->spare, page, __ATOMIC_ACQ_REL);
+	kmem_cache_free(&pipe_page_cache, page);
+}
+
+/*
+	The readable bytes at the head of the buffer which are contiguous in one
+	page, up to avail. Called on the reader side, with reader_lock held.
+ */
+static char* pipe_head_chunk(PICB* pipe, uint avail, uint* len)
+{
+	if(pipe->rpos == PIPE_PAGE_SIZE) {
+		/* The writer has moved on to the next page */
+		pipe_page* page = pipe->head;
+		pipe->head = page->next;
+		pipe->rpos = 0;
+		pipe_page_put(pipe, page);
+	}
+	uint chunk = PIPE_PAGE_SIZE - pipe->rpos;
+	*len = (chunk < avail) ? chunk : avail;
+	return pipe->head->data + pipe->rpos;
+}
+
+/*
+	Move data in or out of the buffer, without blocking. 
+	Returns the number of bytes moved, and in *prev the amount of 
+	data that was available to the reader before the transfer. 
+
+	The side locks are taken with preemption enabled, so that a holder
+	may block (as Splice does) without stalling its core.
+ */
+/*
+	Copy n bytes out of the head of the buffer into the segments, or skip 
+	them if iov is NULL. Called with reader_lock held, for released data. 
+ */
+static void pipe_copy_out(PICB* pipe, const iovec_t* iov, uint iovcnt, uint n)
+{
+	uint i = 0, off = 0;
+	while(n > 0) {
+		uint chunk;
+		char* data = pipe_head_chunk(pipe, n, &chunk);
+		if(iov) {
+			while(off == iov[i].iov_len) { i++; off = 0; }
+			if(chunk > iov[i].iov_len - off) chunk = iov[i].iov_len - off;
+			memcpy((char*)iov[i].iov_base + off, data, chunk);
+			off += chunk;
 		}
+		pipe->rpos += chunk;
+		n -= chunk;
 	}
-	while(isEmpty(pipe->buffer) && pipe->write->refcount!=0)
-	{
-		Cond_Signal(&(pipe->writer_var));
-		Cond_Wait(&kernel_mutex,&(pipe->reader_var));
+}
+
+/*
+	Copy n bytes from the segments to the tail of the buffer, allocating
+	pages as needed. Called with writer_lock held, for available space.
+ */
+static void pipe_copy_in(PICB* pipe, const iovec_t* iov, uint iovcnt, uint n)
+{
+	uint i = 0, off = 0;
+	while(n > 0) {
+		if(pipe->tail == NULL) {
+			/* First write: the reader does not look at head before data is released */
+			pipe->head = pipe->tail = pipe_page_get(pipe);
+			pipe->wpos = 0;
+		}
+		else if(pipe->wpos == PIPE_PAGE_SIZE) {
+			pipe_page* page = pipe_page_get(pipe);
+			pipe->tail->next = page;
+			pipe->tail = page;
+			pipe->wpos = 0;
+		}
+		while(off == iov[i].iov_len) { i++; off = 0; }
+		uint chunk = PIPE_PAGE_SIZE - pipe->wpos;
+		if(chunk > n) chunk = n;
+		if(chunk > iov[i].iov_len - off) chunk = iov[i].iov_len - off;
+		memcpy(pipe->tail->data + pipe->wpos, (const char*)iov[i].iov_base + off, chunk);
+		pipe->wpos += chunk;
+		off += chunk;
+		n -= chunk;
 	}
-	Cond_Broadcast(&(pipe->writer_var));
-	ret=(int)io_buffer_read(pipe->buffer,buf,size,pipe->reader_pointer);
-	return ret;
 }
 
-int pipe_write(void* pipecb,const char* buf,uint size){
-	int ret;
+static uint iov_length(const iovec_t* iov, uint iovcnt)
+{
+	uint len = 0;
+	for(uint i=0; i<iovcnt; i++) len += iov[i].iov_len;
+	return len;
+}
+
+static uint pipe_getv(PICB* pipe, const iovec_t* iov, uint iovcnt, uint* prev)
+{
+	Mutex_Lock(&pipe->reader_lock);
+
+	uint avail = pipe_data(pipe);
+	uint n = iov_length(iov, iovcnt);
+	if(n > avail) n = avail;
+
+	pipe_copy_out(pipe, iov, iovcnt, n);
+	*prev = (n>0) ? __atomic_fetch_sub(&pipe->data, n, __ATOMIC_ACQ_REL) : 0;
+
+	Mutex_Unlock(&pipe->reader_lock);
+	return n;
+}
+
+static uint pipe_putv(PICB* pipe, const iovec_t* iov, uint iovcnt, uint* prev)
+{
+	Mutex_Lock(&pipe->writer_lock);
+
+	uint space = pipe_space(pipe);
+	uint n = iov_length(iov, iovcnt);
+	if(n > space) n = space;
+
+	pipe_copy_in(pipe, iov, iovcnt, n);
+	if(n > 0 && pipe->low_mark > 1 && pipe_data(pipe) == 0)
+		__atomic_store_n(&pipe->pending_since, poll_clock_ms(), __ATOMIC_RELAXED);
+	*prev = (n>0) ? __atomic_fetch_add(&pipe->data, n, __ATOMIC_ACQ_REL) : 0;
+
+	Mutex_Unlock(&pipe->writer_lock);
+	return n;
+}
+
+static inline uint pipe_put(PICB* pipe, const char* buf, uint size, uint* prev)
+{
+	iovec_t iov = { (void*)buf, size };
+	return pipe_putv(pipe, &iov, 1, prev);
+}
+
+/* True if a transfer of n bytes took the data from below mark to mark or above */
+static inline int crossed_up(uint prev, uint n, uint mark)
+{
+	return prev < mark && prev+n >= mark;
+}
+
+/* Readers are woken at the first data, to start waiting for the low mark, and at the low mark */
+static inline int wake_readers(PICB* pipe, uint prev, uint n)
+{
+	return prev == 0 || crossed_up(prev, n, pipe->low_mark);
+}
+
+/* True if a transfer of n bytes took the data from above mark to mark or below */
+static inline int crossed_down(uint prev, uint n, uint mark)
+{
+	return prev > mark && prev-n <= mark;
+}
+
+/*
+	Wait until a reader may proceed: returns 1 if there is data to take,
+	0 at end of file, or -1 if the reader would have to wait and 
+	nonblock is set.
+ */
+static int pipe_wait_data(PICB* pipe, int nonblock)
+{
+	while(1) {
+		if(! pipe_reader_blocked(pipe) && pipe_data(pipe) > 0)
+			return 1;
+		if(__atomic_load_n(&pipe->writer_closed, __ATOMIC_ACQUIRE))
+			/* Data written before the close is visible now */
+			return pipe_data(pipe) > 0;
+		if(nonblock)
+			return -1;
+		if(pipe_data(pipe) == 0)
+			pipe_sleep(pipe, &pipe->reader_var, pipe_empty, &pipe->writer_closed);
+		else {
+			/* Below the low mark, for a bounded time; there are no kernel timers */
+			setTerminationType(1);
+			yield();
+		}
+	}
+}
+
+/*
+	Message mode. Each Write stores a record made of a msg_len_t header
+	and the data, with a single update of the data count, so that readers
+	only ever see whole records. Each Read takes one record.
+	A writer needs room for a whole record, which is not tied to the 
+	watermarks; instead, readers wake up writers whenever some are waiting.
+ */
+typedef uint32_t msg_len_t;
+
+static int pipe_read_message(PICB* pipe, const iovec_t* iov, uint iovcnt, int nonblock)
+{
+	msg_len_t len;
+	iovec_t hdr = { &len, sizeof(len) };
+
+	while(1) {
+		int rc = pipe_wait_data(pipe, nonblock);
+		if(rc <= 0) return rc;
+
+		Mutex_Lock(&pipe->reader_lock);
+		if(pipe_data(pipe) > 0) break;
+		Mutex_Unlock(&pipe->reader_lock);  /* another reader took it */
+	}
+
+	pipe_copy_out(pipe, &hdr, 1, sizeof(len));
+	uint n = iov_length(iov, iovcnt);
+	if(n > len) n = len;
+	pipe_copy_out(pipe, iov, iovcnt, n);
+	pipe_copy_out(pipe, NULL, 0, len-n);    /* the rest is discarded */
+	__atomic_fetch_sub(&pipe->data, sizeof(len)+len, __ATOMIC_SEQ_CST);
+
+	Mutex_Unlock(&pipe->reader_lock);
+
+	if(__atomic_load_n(&pipe->writers_waiting, __ATOMIC_SEQ_CST) > 0 || wait_queue_active(&pipe->poll_queue))
+		pipe_wakeup(pipe, &pipe->writer_var);
+	return n;
+}
+
+static int pipe_write_message(PICB* pipe, const iovec_t* iov, uint iovcnt, int nonblock)
+{
+	msg_len_t len = iov_length(iov, iovcnt);
+	uint need = sizeof(len) + len;
+	iovec_t hdr = { &len, sizeof(len) };
+
+	if(len == 0) return 0;
+
+	while(1) {
+		/* The limit may be lowered by PipeSetLimit while we sleep */
+		if(need > pipe->limit) return -1;
+
+		Mutex_Lock(&pipe->writer_lock);
+		if(pipe_space(pipe) >= need) break;
+		Mutex_Unlock(&pipe->writer_lock);
+		if(nonblock) return -1;
+
+		/* Sleep until a reader frees enough space */
+		int pre = preempt_off;
+		Mutex_Lock(&pipe->wait_lock);
+		__atomic_add_fetch(&pipe->writers_waiting, 1, __ATOMIC_SEQ_CST);
+		while(pipe_space(pipe) < need && need <= pipe->limit
+			&& ! __atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE)) {
+			setTerminationType(3);
+			Cond_Wait(&pipe->wait_lock, &pipe->writer_var);
+		}
+		__atomic_sub_fetch(&pipe->writers_waiting, 1, __ATOMIC_SEQ_CST);
+		Mutex_Unlock(&pipe->wait_lock);
+		if(pre) preempt_on;
+
+		if(__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE))
+			return -1;
+	}
+
+	pipe_copy_in(pipe, &hdr, 1, sizeof(len));
+	pipe_copy_in(pipe, iov, iovcnt, len);
+	uint prev = __atomic_fetch_add(&pipe->data, need, __ATOMIC_ACQ_REL);
+
+	Mutex_Unlock(&pipe->writer_lock);
+
+	if(prev == 0)
+		pipe_wakeup(pipe, &pipe->reader_var);
+	return len;
+}
+
+int pipe_readv(void* pipecb, const iovec_t* iov, uint iovcnt, uint flags){
+	PICB * pipe = (PICB*)pipecb;	
+	int nonblock = (flags & FID_NONBLOCK);
+	uint n, prev;
+
+	if(iov_length(iov, iovcnt)==0) return 0;
+	if(pipe->flags & PIPE_MESSAGE)
+		return pipe_read_message(pipe, iov, iovcnt, nonblock);
+
+	do {
+		int rc = pipe_wait_data(pipe, nonblock);
+		if(rc <= 0) return rc;
+	} while((n = pipe_getv(pipe, iov, iovcnt, &prev)) == 0);   /* another reader took it */
+
+	/* Wake up writers only if enough space was freed */
+	if(crossed_down(prev, n, pipe->high_mark))
+		pipe_wakeup(pipe, &pipe->writer_var);
+	return n;
+}
+
+int pipe_writev(void* pipecb, const iovec_t* iov, uint iovcnt, uint flags){
+	PICB * pipe = (PICB*)pipecb;
+	int nonblock = (flags & FID_NONBLOCK);
+	uint n, prev;
+
+	if(__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE))
+		return -1;
+	if(pipe->flags & PIPE_MESSAGE)
+		return pipe_write_message(pipe, iov, iovcnt, nonblock);
+	if(iov_length(iov, iovcnt)==0) return 0;
+
+	while((n = pipe_putv(pipe, iov, iovcnt, &prev)) == 0) {
+		if(nonblock) return -1;
+		pipe_sleep(pipe, &pipe->writer_var, pipe_writer_blocked, &pipe->reader_closed);
+		if(__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE))
+			return -1;
+	}
+
+	/* Wake up readers only if enough data has accumulated */
+	if(wake_readers(pipe, prev, n))
+		pipe_wakeup(pipe, &pipe->reader_var);
+	return n;
+}
+
+/*
+	Poll events. A read does not block when a read would find data or
+	end of file; a write does not block while the data is at the high mark
+	or below (for message mode, when a header and some data fit).
+ */
+uint pipe_reader_poll(void* pipecb, poll_table* pt)
+{
+	PICB * pipe = (PICB*)pipecb;
+	uint events = 0;
+
+	poll_wait(pt, &pipe->poll_queue);
+	if(__atomic_load_n(&pipe->writer_closed, __ATOMIC_ACQUIRE))
+		events |= POLL_HANGUP;
+	if(pipe_data(pipe) > 0 && (! pipe_reader_blocked(pipe) || (events & POLL_HANGUP)))
+		events |= POLL_READ;
+	return events;
+}
+
+uint pipe_writer_poll(void* pipecb, poll_table* pt)
+{
 	PICB * pipe = (PICB*)pipecb;
-	if(pipe->read->refcount ==0)
-	{
-		return -1;	
-	}	
-	while(isFull(pipe->buffer) && pipe->read->refcount!=0)
-	{
-		Cond_Signal(&(pipe->reader_var));
-		Cond_Wait(&kernel_mutex,&(pipe->writer_var));
+
+	poll_wait(pt, &pipe->poll_queue);
+	if(__atomic_load_n(&pipe->reader_closed, __ATOMIC_ACQUIRE))
+		return POLL_ERROR;
+	if(pipe->flags & PIPE_MESSAGE)
+		return (pipe_space(pipe) > sizeof(msg_len_t)) ? POLL_WRITE : 0;
+	return pipe_writer_blocked(pipe) ? 0 : POLL_WRITE;
+}
+
+int pipe_read(void* pipecb, char* buf, uint size){
+	iovec_t iov = { buf, size };
+	return pipe_readv(pipecb, &iov, 1, 0);
+}
+
+int pipe_write(void* pipecb,const char* buf,uint size){
+	iovec_t iov = { (void*)buf, size };
+	return pipe_writev(pipecb, &iov, 1, 0);
+}
+
+
+/* The PICB of a pipe end, or NULL. Called with kernel_mutex held. */
+static PICB* get_pipe(Fid_t fid)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb && (fcb->streamfunc == &ReaderOps || fcb->streamfunc == &WriterOps))
+		return (PICB*)fcb->streamobj;
+	return NULL;
+}
+
+
+/*
+	Splice: the output stream is written directly from the pages of the 
+	pipe. The reader_lock is held throughout, since the pages being written
+	out must not be consumed by another reader; the output may block.
+ */
+static int pipe_splice(PICB* pipe, int (*devwrite)(void*, const char*, uint), void* obj, uint n)
+{
+	if(n==0) return 0;
+	if(! pipe_wait_data(pipe, 0)) return 0;
+
+	Mutex_Lock(&pipe->reader_lock);
+
+	uint avail = pipe_data(pipe);
+	if(avail > n) avail = n;
+
+	uint moved = 0;
+	int rc = 0;
+	while(moved < avail) {
+		uint chunk;
+		char* data = pipe_head_chunk(pipe, avail-moved, &chunk);
+		rc = devwrite(obj, data, chunk);
+		if(rc <= 0) break;
+
+		pipe->rpos += rc;
+		moved += rc;
+		uint prev = __atomic_fetch_sub(&pipe->data, rc, __ATOMIC_ACQ_REL);
+		if(crossed_down(prev, rc, pipe->high_mark))
+			pipe_wakeup(pipe, &pipe->writer_var);
+
+		if(rc < chunk) break;	/* the output is full */
+	}
+
+	Mutex_Unlock(&pipe->reader_lock);
+
+	return (moved>0 || rc==0) ? (int)moved : -1;
+}
+
+int Splice(Fid_t fid_in, Fid_t fid_out, unsigned int n)
+{
+	int retcode = -1;
+
+	Mutex_Lock(&kernel_mutex);
+	FCB* in = get_fcb(fid_in);
+	FCB* out = get_fcb(fid_out);
+
+	if(in && out && in->streamfunc == &ReaderOps && out->streamfunc->Write
+		&& out->streamobj != in->streamobj
+		&& !(((PICB*)in->streamobj)->flags & PIPE_MESSAGE)) {
+		PICB* pipe = (PICB*) in->streamobj;
+		int (*devwrite)(void*, const char*, uint) = out->streamfunc->Write;
+		void* obj = out->streamobj;
+
+		FCB_incref(in);
+		FCB_incref(out);
+
+		/* We must not go into non-preemptive domain with kernel_mutex locked */
+		Mutex_Unlock(&kernel_mutex);
+		retcode = pipe_splice(pipe, devwrite, obj, n);
+		Mutex_Lock(&kernel_mutex);
+
+		FCB_decref(in);
+		FCB_decref(out);
+	}
+	Mutex_Unlock(&kernel_mutex);
+
+	return retcode;
+}
+
+/*
+	Tee: the buffered data of the input pipe is walked page by page, without
+	consuming it, and written into the output pipe. The reader_lock of the 
+	input is held, so that the pages are not consumed meanwhile. Only the 
+	first write may block; after that, we stop when the output is full.
+
+	The pages themselves are not shared between the pipes, since the writer 
+	of a pipe fills its tail page in place; each byte is copied once.
+ */
+static int pipe_tee(PICB* pipe, PICB* out, uint n)
+{
+	if(n==0) return 0;
+	if(! pipe_wait_data(pipe, 0)) return 0;
+
+	Mutex_Lock(&pipe->reader_lock);
+
+	uint avail = pipe_data(pipe);
+	if(avail > n) avail = n;
+
+	pipe_page* page = pipe->head;
+	uint off = pipe->rpos;
+	uint moved = 0;
+	int rc = 0;
+	while(moved < avail) {
+		if(off == PIPE_PAGE_SIZE) {
+			page = page->next;
+			off = 0;
+		}
+		uint chunk = PIPE_PAGE_SIZE - off;
+		if(chunk > avail-moved) chunk = avail-moved;
+
+		if(moved==0)
+			rc = pipe_write(out, page->data+off, chunk);
+		else {
+			uint prev;
+			rc = pipe_put(out, page->data+off, chunk, &prev);
+			if(wake_readers(out, prev, rc))
+				pipe_wakeup(out, &out->reader_var);
+		}
+		if(rc <= 0) break;
+
+		off += rc;
+		moved += rc;
+		if(rc < chunk) break;	/* the output is full */
+	}
+
+	Mutex_Unlock(&pipe->reader_lock);
+
+	return (moved>0 || rc==0) ? (int)moved : -1;
+}
+
+int Tee(Fid_t fid_in, Fid_t fid_out, unsigned int n)
+{
+	int retcode = -1;
+
+	Mutex_Lock(&kernel_mutex);
+	FCB* in = get_fcb(fid_in);
+	FCB* out = get_fcb(fid_out);
+
+	if(in && out && in->streamfunc == &ReaderOps && out->streamfunc == &WriterOps
+		&& out->streamobj != in->streamobj
+		&& !(((PICB*)in->streamobj)->flags & PIPE_MESSAGE)
+		&& !(((PICB*)out->streamobj)->flags & PIPE_MESSAGE)) {
+		FCB_incref(in);
+		FCB_incref(out);
+
+		/* We must not go into non-preemptive domain with kernel_mutex locked */
+		Mutex_Unlock(&kernel_mutex);
+		retcode = pipe_tee((PICB*)in->streamobj, (PICB*)out->streamobj, n);
+		Mutex_Lock(&kernel_mutex);
+
+		FCB_decref(in);
+		FCB_decref(out);
 	}
-	Cond_Broadcast(&(pipe->reader_var));
-	ret=(int)io_buffer_write(pipe->buffer,buf,size,pipe->writer_pointer);
-	return ret;
+	Mutex_Unlock(&kernel_mutex);
+
+	return retcode;
 }
 
 
+int PipeSetWatermarks(Fid_t fid, unsigned int lo, unsigned int hi)
+{
+	int retcode = -1;
+
+	Mutex_Lock(&kernel_mutex);
+	PICB* pipe = get_pipe(fid);
+	if(pipe && !(pipe->flags & PIPE_MESSAGE) && lo >= 1 && lo <= pipe->limit && hi < pipe->limit) {
+		pipe->low_mark = lo;
+		pipe->high_mark = hi;
+
+		/* Let the sleepers re-evaluate */
+		pipe_wakeup(pipe, &pipe->reader_var);
+		pipe_wakeup(pipe, &pipe->writer_var);
+		retcode = 0;
+	}
+	Mutex_Unlock(&kernel_mutex);
+
+	return retcode;
+}
+
+
+int PipeSetLimit(Fid_t fid, unsigned int limit)
+{
+	int retcode = -1;
+
+	if(limit < PIPE_PAGE_SIZE || limit > PIPE_MAX_LIMIT)
+		return -1;
+
+	Mutex_Lock(&kernel_mutex);
+	PICB* pipe = get_pipe(fid);
+	if(pipe) {
+		/* Keep the watermarks in range; a default high mark follows the limit */
+		if(pipe->high_mark == pipe->limit-1 || pipe->high_mark >= limit)
+			pipe->high_mark = limit-1;
+		if(pipe->low_mark > limit)
+			pipe->low_mark = limit;
+		pipe->limit = limit;
+
+		/* Writers re-check the space, and message writers the limit */
+		pipe_wakeup(pipe, &pipe->reader_var);
+		pipe_wakeup(pipe, &pipe->writer_var);
+		retcode = 0;
+	}
+	Mutex_Unlock(&kernel_mutex);
+
+	return retcode;
+}
 
@@ -0,0 +1,214 @@
+
+#include <assert.h>
+#include <time.h>
+#include "kernel_poll.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_streams.h"
+
+/*
+	Wait queues.
+
+	The lock order is: kernel_mutex, stream locks, wait queue lock, 
+	poll table lock.
+	Wait queue and poll table locks are only taken with preemption off.
+ */
+
+void wait_queue_init(wait_queue* q)
+{
+	q->lock = MUTEX_INIT;
+	rlnode_init(&q->waiters, NULL);
+	q->count = 0;
+}
+
+
+void wait_queue_notify(wait_queue* q)
+{
+	if(! wait_queue_active(q)) return;
+
+	int pre = preempt_off;
+	Mutex_Lock(&q->lock);
+	for(rlnode* p = q->waiters.next; p != &q->waiters; p = p->next) {
+		poll_table* pt = ((poll_entry*)p->obj)->table;
+		if(pt->notify)
+			pt->notify(pt);
+		else
+			poll_table_trigger(pt);
+	}
+	Mutex_Unlock(&q->lock);
+	if(pre) preempt_on;
+}
+
+
+void poll_table_init(poll_table* pt)
+{
+	pt->lock = MUTEX_INIT;
+	pt->ready = COND_INIT;
+	pt->triggered = 0;
+	pt->count = pt->size = 0;
+	pt->entries = NULL;
+	pt->notify = NULL;
+}
+
+
+void poll_table_trigger(poll_table* pt)
+{
+	int pre = preempt_off;
+	Mutex_Lock(&pt->lock);
+	pt->triggered = 1;
+	Cond_Broadcast(&pt->ready);
+	Mutex_Unlock(&pt->lock);
+	if(pre) preempt_on;
+}
+
+
+void poll_wait(poll_table* pt, wait_queue* q)
+{
+	if(pt == NULL) return;
+
+	/*
+		The entries are linked into wait queues, so they cannot move:
+		the table is sized by the caller, before any registration.
+	 */
+	assert(pt->count < pt->size);
+	poll_entry* e = & pt->entries[pt->count++];
+	rlnode_init(&e->node, e);
+	e->queue = q;
+	e->table = pt;
+
+	int pre = preempt_off;
+	Mutex_Lock(&q->lock);
+	rlist_push_back(&q->waiters, &e->node);
+	__atomic_add_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+	Mutex_Unlock(&q->lock);
+	if(pre) preempt_on;
+}
+
+
+long poll_clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000l + ts.tv_nsec/1000000l;
+}
+
+
+int poll_table_wait(poll_table* pt, timeout_t timeout)
+{
+	if(timeout < 0) {
+		int pre = preempt_off;
+		Mutex_Lock(&pt->lock);
+		while(! pt->triggered) {
+			setTerminationType(3);
+			Cond_Wait(&pt->lock, &pt->ready);
+		}
+		Mutex_Unlock(&pt->lock);
+		if(pre) preempt_on;
+		return 1;
+	}
+
+	/*
+		There are no kernel timers to wake us up, so a bounded wait
+		gives up the cpu until it is notified or the time is up.
+	 */
+	long deadline = poll_clock_ms() + timeout;
+	while(! __atomic_load_n(&pt->triggered, __ATOMIC_ACQUIRE)) {
+		if(poll_clock_ms() >= deadline) return 0;
+		setTerminationType(1);
+		yield();
+	}
+	return 1;
+}
+
+
+void poll_table_release(poll_table* pt)
+{
+	int pre = preempt_off;
+	for(uint i=0; i<pt->count; i++) {
+		wait_queue* q = pt->entries[i].queue;
+		Mutex_Lock(&q->lock);
+		rlist_remove(&pt->entries[i].node);
+		__atomic_sub_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+		Mutex_Unlock(&q->lock);
+	}
+	if(pre) preempt_on;
+	free(pt->entries);
+	poll_table_init(pt);
+}
+
+
+/*
+	The events ready on a stream. Streams which cannot be polled
+	are always ready.
+ */
+uint stream_poll(FCB* fcb, poll_table* pt)
+{
+	file_ops* ops = fcb->streamfunc;
+	if(ops->Poll == NULL)
+		return POLL_READ | POLL_WRITE;
+	return ops->Poll(fcb->streamobj, pt);
+}
+
+
+int Poll(const Fid_t* fids, unsigned int* events, unsigned int n, timeout_t timeout)
+{
+	if(n > 0 && (fids == NULL || events == NULL))
+		return -1;
+
+	FCB** fcbs = (FCB**) xmalloc((n>0 ? n : 1)*sizeof(FCB*));
+	unsigned int* wanted = (unsigned int*) xmalloc((n>0 ? n : 1)*sizeof(unsigned int));
+
+	/* Pin the streams, so that they are not closed while we wait */
+	Mutex_Lock(&kernel_mutex);
+	for(uint i=0; i<n; i++) {
+		fcbs[i] = (fids[i] >= 0) ? get_fcb(fids[i]) : NULL;
+		if(fcbs[i]) FCB_incref(fcbs[i]);
+		wanted[i] = events[i] & (POLL_READ|POLL_WRITE);
+	}
+	Mutex_Unlock(&kernel_mutex);
+
+	/* A stream may register on at most two wait queues */
+	poll_table pt;
+	poll_table_init(&pt);
+	pt.size = 2*n;
+	pt.entries = (poll_entry*) xmalloc((n>0 ? 2*n : 1)*sizeof(poll_entry));
+
+	long deadline = (timeout > 0) ? poll_clock_ms() + timeout : 0;
+	int ready;
+	for(int first = 1; ; first = 0) {
+		__atomic_store_n(&pt.triggered, 0, __ATOMIC_SEQ_CST);
+
+		ready = 0;
+		for(uint i=0; i<n; i++) {
+			uint rev;
+			if(fids[i] < 0)
+				rev = 0;
+			else if(fcbs[i] == NULL)
+				rev = POLL_INVALID;
+			else
+				rev = stream_poll(fcbs[i], (first && timeout != 0) ? &pt : NULL) & (wanted[i]|POLL_HANGUP|POLL_ERROR);
+			events[i] = rev;
+			if(rev) ready++;
+		}
+
+		if(ready > 0 || timeout == 0) break;
+
+		timeout_t left = -1;
+		if(timeout > 0) {
+			left = deadline - poll_clock_ms();
+			if(left <= 0) break;
+		}
+		if(! poll_table_wait(&pt, left)) break;
+	}
+
+	poll_table_release(&pt);
+
+	Mutex_Lock(&kernel_mutex);
+	for(uint i=0; i<n; i++)
+		if(fcbs[i]) FCB_decref(fcbs[i]);
+	Mutex_Unlock(&kernel_mutex);
+
+	free(fcbs);
+	free(wanted);
+	return ready;
+}
@@ -0,0 +1,114 @@
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+#include "tinyos.h"
+#include "util.h"
+
+/**
+	@file kernel_poll.h
+	@brief Stream wait queues and polling.
+
+	@defgroup poll Polling.
+	@ingroup kernel
+	@brief Stream wait queues and polling.
+
+	A stream which can be polled keeps a @ref wait_queue, and implements
+	the @c Poll method of its @c file_ops.
+
+	The @c Poll method returns the events which are currently ready on
+	the stream. If it is passed a @ref poll_table, it first registers
+	the table on the wait queue(s) of the stream by @ref poll_wait.
+	Afterwards, the stream calls @ref wait_queue_notify whenever its
+	readiness may have changed, waking up the thread waiting on the table.
+	Since the registration happens before readiness is computed, no
+	change is missed.
+
+	@{
+*/
+
+/** @brief A wait queue of a stream. */
+typedef struct wait_queue {
+	Mutex lock;			/**< @brief Protects the list */
+	rlnode waiters;		/**< @brief The list of poll_entry */
+	int count;			/**< @brief Length of the list, for a quick check */
+} wait_queue;
+
+/** @brief Initialize a wait queue. */
+void wait_queue_init(wait_queue* q);
+
+/**
+	@brief Wake up the poll tables registered on a wait queue.
+
+	This is cheap when nobody is polling the stream. It may be called
+	with preemption on or off, and with @c kernel_mutex held (e.g., by
+	the @c Close method of a stream); it never takes @c kernel_mutex.
+*/
+void wait_queue_notify(wait_queue* q);
+
+/** @brief Return true if some poll table is registered on the queue. */
+static inline int wait_queue_active(wait_queue* q)
+{
+	return __atomic_load_n(&q->count, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+struct poll_table;
+
+/** @brief The registration of a poll table on a wait queue. */
+typedef struct poll_entry {
+	rlnode node;				/**< @brief Node in the wait queue */
+	wait_queue* queue;			/**< @brief The wait queue */
+	struct poll_table* table;	/**< @brief The poll table */
+} poll_entry;
+
+/** @brief A set of registrations, on behalf of a waiting thread. */
+typedef struct poll_table {
+	Mutex lock;				/**< @brief Protects @c triggered */
+	CondVar ready;			/**< @brief The threads wait here */
+	int triggered;			/**< @brief Set by notifications */
+	uint count;				/**< @brief Number of entries used */
+	uint size;				/**< @brief Number of entries allocated */
+	poll_entry* entries;	/**< @brief The registrations */
+
+	/** @brief If not NULL, called on notifications instead of @ref poll_table_trigger.
+
+		It is called with preemption off and the wait queue locked, and
+		maybe with @c kernel_mutex held; it must not block or take
+		@c kernel_mutex.
+	 */
+	void (*notify)(struct poll_table* pt);
+} poll_table;
+
+/** @brief Initialize an empty poll table. */
+void poll_table_init(poll_table* pt);
+
+/**
+	@brief Register a poll table on a wait queue.
+
+	This is called by the @c Poll method of streams. If @c pt is NULL,
+	it does nothing.
+*/
+void poll_wait(poll_table* pt, wait_queue* q);
+
+/** @brief Set the table as triggered, waking up the threads waiting on it. */
+void poll_table_trigger(poll_table* pt);
+
+/**
+	@brief Wait until the poll table is notified.
+
+	With a negative @c timeout, the wait is indefinite. Else, the
+	call returns after at most @c timeout milliseconds.
+
+	@returns 1 if the table was notified, 0 on timeout
+*/
+int poll_table_wait(poll_table* pt, timeout_t timeout);
+
+/** @brief A monotonic clock in milliseconds, for timeouts. */
+long poll_clock_ms();
+
+/** @brief Remove all registrations of the table, and free its storage. */
+void poll_table_release(poll_table* pt);
+
+/** @} */
+
+#endif
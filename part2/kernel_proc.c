@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_slab.h"
 
 
 /* 
@@ -19,6 +20,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* A bitmap of the pids in use, so that OpenInfo skips the free ones */
+static uint64_t pid_used[MAX_PROC/64];
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -33,10 +37,10 @@ Pid_t get_pid(PCB* pcb)
 static inline void initialize_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
+  pcb->seq = 0;
   pcb->argl = 0;
   pcb->args = NULL;
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  fidt_init(& pcb->FIDT);
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
@@ -75,16 +79,39 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  The fields of a PCB reported by OpenInfo are changed, with kernel_mutex
+  held, between pcb_update_begin and pcb_update_end. This makes the
+  sequence number odd meanwhile, so that readers without the lock can
+  tell when they saw a partial update.
+ */
+static inline void pcb_update_begin(PCB* pcb)
+{
+  __atomic_store_n(&pcb->seq, pcb->seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void pcb_update_end(PCB* pcb)
+{
+  __atomic_store_n(&pcb->seq, pcb->seq+1, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Must be called with kernel_mutex held. The update of the PCB
+  is ended by the caller, after it has set up the process.
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
   if(pcb_freelist != NULL) { 
     pcb = pcb_freelist;
+    pcb_update_begin(pcb);
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
+
+    Pid_t pid = pcb - PT;
+    __atomic_fetch_or(&pid_used[pid/64], 1ull << (pid%64), __ATOMIC_RELEASE);
   }
   return pcb;
 }
@@ -94,7 +121,13 @@ PCB* acquire_PCB()
 */
 void release_PCB(PCB* pcb)
 {
+  Pid_t pid = pcb - PT;
+  __atomic_fetch_and(&pid_used[pid/64], ~(1ull << (pid%64)), __ATOMIC_RELEASE);
+
+  pcb_update_begin(pcb);
   pcb->pstate = FREE;
+  pcb_update_end(pcb);
+  fidt_destroy(& pcb->FIDT);
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
   process_count--;
@@ -128,12 +161,20 @@ void start_main_thread()
 /*
 	System call to create a new process.
  */
-Pid_t Exec(Task call, int argl, void* args) ////////////////////////////////////////////////////EDITED////////////////////////////////////////////////
+Pid_t Exec(Task call, int argl, void* args)
+{
+  Mutex_Lock(&kernel_mutex);
+  Pid_t pid = exec_process(call, argl, args);
+  Mutex_Unlock(&kernel_mutex);
+  return pid;
+}
+
+/* Exec, called with kernel_mutex held */
+Pid_t exec_process(Task call, int argl, void* args) ////////////////////////////////////////////////////EDITED////////////////////////////////////////////////
 {
   PCB *curproc, *newproc;
 	PTCB * ptcb;
   
-  Mutex_Lock(&kernel_mutex);
   /* The new process PCB */
   newproc = acquire_PCB();
 
@@ -153,10 +194,12 @@ Pid_t Exec(Task call, int argl, void* args) ////////////////////////////////////
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+    for(int i=0; i<fidt_size(& curproc->FIDT); i++) {
+       FCB* fcb = fidt_get(& curproc->FIDT, i);
+       if(fcb) {
+          FCB_incref(fcb);
+          fidt_set(& newproc->FIDT, i, fcb);
+       }
     }
   }
   /* Set the main thread's function */
@@ -170,6 +213,8 @@ Pid_t Exec(Task call, int argl, void* args) ////////////////////////////////////
   }
   else
     newproc->args=NULL;
+  pcb_update_end(newproc);
+
   /* 
     Create and wake up the thread for the main function. This must be the last thing
     we do, because once we wakeup the new thread it may run! so we need to have finished
@@ -189,7 +234,6 @@ Pid_t Exec(Task call, int argl, void* args) ////////////////////////////////////
 		/////EDITED/////
   }
 finish:
-  Mutex_Unlock(&kernel_mutex);
   return get_pid(newproc);
 }
 
@@ -306,15 +350,18 @@ void Exit(int exitval)  ////////////////////////////////////////////////////EDIT
 
   /* Do all the other cleanup we want here, close files etc. */
   if(curproc->args) {
-
+    pcb_update_begin(curproc);
     curproc->args = NULL;
+    pcb_update_end(curproc);
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
+  for(int i=0;i<fidt_size(& curproc->FIDT);i++) {
+    FCB* fcb = fidt_get(& curproc->FIDT, i);
+    if(fcb != NULL) {
+      fidt_set(& curproc->FIDT, i, NULL);
+      event_fid_closed(curproc, i, fcb);
+      FCB_decref(fcb);
     }
   }
 	
@@ -323,7 +370,9 @@ void Exit(int exitval)  ////////////////////////////////////////////////////EDIT
   PCB* initpcb = get_pcb(1);
   while(!is_rlist_empty(& curproc->children_list)) {
     rlnode* child = rlist_pop_front(& curproc->children_list);
+    pcb_update_begin(child->pcb);
     child->pcb->parent = initpcb;
+    pcb_update_end(child->pcb);
     rlist_push_front(& initpcb->children_list, child);
   }
 
@@ -344,7 +393,9 @@ void Exit(int exitval)  ////////////////////////////////////////////////////EDIT
   curproc->main_thread = NULL;
 	
   /* Now, mark the process as exited. */
+  pcb_update_begin(curproc);
   curproc->pstate = ZOMBIE;
+  pcb_update_end(curproc);
   curproc->exitval = exitval;
 	/////////////////EDITED///////////////////////
 	//rlnode* helper = (&curproc->ptcbTable)->next;	
@@ -391,6 +442,8 @@ Pid_t get_ptid(PTCB* ptcb)
 	}
 }
 
+static kmem_cache ptcb_cache = KMEM_CACHE_INIT("PTCB", PTCB);
+
 void release_PTCB(PTCB* ptcb,PCB* pcb){
 	rlnode* prev;
 	rlnode* next;
@@ -398,7 +451,7 @@ void release_PTCB(PTCB* ptcb,PCB* pcb){
 	next = (&ptcb->ptcb_node)->next;
 	prev->next = next;
 	next->prev =prev;
-	free(ptcb);
+	kmem_cache_free(&ptcb_cache, ptcb);
 	pcb->ptcb_count--;
 }
 
@@ -444,7 +497,7 @@ void popFrontPTCB(PCB* pcb){
 PTCB* acquire_PTCB(PCB* pcb){
 
 	PTCB* ptcb;	
-	ptcb=(PTCB*)xmalloc(sizeof(PTCB));
+	ptcb=(PTCB*)kmem_cache_alloc(&ptcb_cache);
 
 	ptcb->ptid = pcb->ptcb_count;
 	pcb->ptcb_count++;
@@ -458,8 +511,139 @@ PTCB* acquire_PTCB(PCB* pcb){
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
+/*
+  The information stream.
+
+  Reads walk the process table without kernel_mutex. The bitmap of used
+  pids skips the free PCBs, and each PCB is copied optimistically, and
+  copied again if its sequence number shows that it changed meanwhile.
+  After a few failed attempts, the PCB is copied under kernel_mutex.
+ */
+#define PROCINFO_ATTEMPTS 4
+
+typedef struct procinfo_control_block {
+  Pid_t cursor;       /* the next pid to report */
+} PROCINFOCB;
+
+static int procinfo_read(void* this, char* buf, uint size);
+static int procinfo_close(void* this);
+
+file_ops ProcInfoOps = {
+  .Open = NULL,
+  .Read = procinfo_read,
+  .Close = procinfo_close
+};
+
+
+/* The lowest used pid which is not less than pid, or NOPROC */
+static Pid_t next_used_pid(Pid_t pid)
+{
+  while(pid < MAX_PROC) {
+    uint64_t word = __atomic_load_n(&pid_used[pid/64], __ATOMIC_ACQUIRE);
+    word &= ~0ull << (pid%64);
+    if(word)
+      return (pid & ~63) + __builtin_ctzll(word);
+    pid = (pid & ~63) + 64;
+  }
+  return NOPROC;
+}
+
+/*
+  Copy the information of a PCB. The arguments are only copied once the
+  rest has been validated, so that argl and args belong together.
+  Arguments are never freed while the PCB is in use, and a stale args 
+  pointer only leads to another attempt.
+  Returns 0 if the PCB changed meanwhile.
+ */
+static int procinfo_try_copy(PCB* pcb, procinfo* info, int* used)
+{
+  unsigned int seq = __atomic_load_n(&pcb->seq, __ATOMIC_ACQUIRE);
+  if(seq & 1) return 0;
+
+  *used = (pcb->pstate != FREE);
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE);
+  info->thread_count = pcb->ptcb_count;
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  void* args = pcb->args;
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if(__atomic_load_n(&pcb->seq, __ATOMIC_RELAXED) != seq) return 0;
+  if(! *used) return 1;
+
+  uint len = (info->argl < PROCINFO_MAX_ARGS_SIZE) ? info->argl : PROCINFO_MAX_ARGS_SIZE;
+  if(args) memcpy(info->args, args, len);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&pcb->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* Copy the information of a PCB, returns 0 if it is free */
+static int procinfo_copy(PCB* pcb, procinfo* info)
+{
+  int used;
+  for(int i=0; i<PROCINFO_ATTEMPTS; i++)
+    if(procinfo_try_copy(pcb, info, &used))
+      return used;
+
+  /* The PCB is busy, wait for the update */
+  Mutex_Lock(&kernel_mutex);
+  procinfo_try_copy(pcb, info, &used);
+  Mutex_Unlock(&kernel_mutex);
+  return used;
+}
+
+
+static int procinfo_read(void* this, char* buf, uint size)
+{
+  PROCINFOCB* picb = (PROCINFOCB*) this;
+
+  if(size < sizeof(procinfo)) return -1;
+
+  uint count = 0;
+  while(size - count >= sizeof(procinfo)) {
+    Pid_t pid = next_used_pid(picb->cursor);
+    if(pid == NOPROC) {
+      picb->cursor = MAX_PROC;
+      break;
+    }
+    picb->cursor = pid+1;
+
+    procinfo info;
+    if(procinfo_copy(&PT[pid], &info)) {
+      memcpy(buf+count, &info, sizeof(procinfo));
+      count += sizeof(procinfo);
+    }
+  }
+  return count;
+}
+
+
+static int procinfo_close(void* this)
+{
+  free(this);
+  return 0;
+}
+
+
 Fid_t OpenInfo()
 {
-	return NOFILE;
+  Fid_t fid;
+  FCB* fcb;
+
+  PROCINFOCB* picb = (PROCINFOCB*) xmalloc(sizeof(PROCINFOCB));
+  picb->cursor = 0;
+
+  Mutex_Lock(&kernel_mutex);
+  if(! FCB_reserve(1, &fid, &fcb)) {
+    Mutex_Unlock(&kernel_mutex);
+    free(picb);
+    return NOFILE;
+  }
+  FCB_setup(fcb, picb, &ProcInfoOps);
+  Mutex_Unlock(&kernel_mutex);
+  return fid;
 }
 
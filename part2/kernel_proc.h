@@ -36,6 +36,73 @@ typedef struct arguments_tcb{
 	rlnode args_node;
 	Task task;
 }ARGST;
+/**
+  @brief The slots of a fid table.
+
+  When the table grows, the array is replaced by a larger copy. Since
+  arrays are read without locks (see @c FCB_lookup), replaced arrays
+  are kept in the @c retired list, and freed with the table.
+ */
+typedef struct fid_array {
+  unsigned int size;          /**< The number of slots */
+  struct fid_array* retired;  /**< The previous, smaller, array */
+  FCB* slot[];                /**< The slots */
+} fid_array;
+
+/** @brief The number of words in the bitmap of a fid table */
+#define FIDT_WORDS ((MAX_FILEID+63)/64)
+
+/**
+  @brief The fid table of a process.
+
+  The table starts empty, and grows by doubling, up to @c MAX_FILEID
+  slots. The bitmap of used fids, together with a summary word marking
+  the full bitmap words, finds the lowest free fid in constant time.
+  
+  The table is only changed with @c kernel_mutex held.
+  @see fidt_alloc
+ */
+typedef struct fid_table {
+  fid_array* array;     /**< The slots, or NULL */
+  uint64_t* used;       /**< Bitmap of used fids, @c FIDT_WORDS words, or NULL */
+  uint64_t full;        /**< Bit @c w is set when word @c w of @c used is full */
+} fid_table;
+
+/** @brief Initialize an empty fid table. */
+void fidt_init(fid_table* t);
+
+/** @brief Free the storage of a fid table, whose fids are all closed. */
+void fidt_destroy(fid_table* t);
+
+/**
+  @brief Return the FCB of a fid, or NULL.
+
+  This can be called without @c kernel_mutex.
+ */
+FCB* fidt_get(fid_table* t, Fid_t fid);
+
+/**
+  @brief Set the FCB of a fid, or clear it if @c fcb is NULL.
+
+  The table grows if needed. The fid must be legal.
+ */
+void fidt_set(fid_table* t, Fid_t fid, FCB* fcb);
+
+/**
+  @brief Allocate the lowest free fid.
+
+  The fid is marked as used, with a NULL FCB, until it is
+  set by @ref fidt_set.
+  @returns the fid, or NOFILE if the table is full.
+ */
+Fid_t fidt_alloc(fid_table* t);
+
+/** @brief The number of slots of the table. Fids beyond it are free. */
+static inline unsigned int fidt_size(fid_table* t)
+{
+  return t->array ? t->array->size : 0;
+}
+
 /**
   @brief Process Control Block.
 
@@ -43,6 +110,7 @@ typedef struct arguments_tcb{
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< The pid state for this PCB */
+  unsigned int seq;       /**< Odd while the fields reported by @c OpenInfo change */
 
   PCB* parent;            /**< Parent's pcb. */
   int exitval;            /**< The exit value */
@@ -59,7 +127,7 @@ typedef struct process_control_block {
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
 
-  FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  fid_table FIDT;         /**< The fileid table of the process */
 	//ARGST* argst;
 	rlnode argsTable;
 	int arguments_count;
@@ -129,6 +197,13 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Create a new process, as in @c Exec.
+
+  This is the body of @c Exec, called with @c kernel_mutex held.
+*/
+Pid_t exec_process(Task call, int argl, void* args);
+
 /** @} */
 
 #endif
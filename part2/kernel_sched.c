@@ -153,6 +153,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->phase = CTX_CLEAN;
   tcb->state_spinlock = MUTEX_INIT;
   tcb->thread_func = func;
+  tcb->thread_arg = NULL;
 	tcb->tt = Undefined;
 	tcb->priority = -1; //--------------------------------------------------------------------------------------------------------------------------------------------
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
@@ -90,6 +90,7 @@ typedef struct thread_control_block
   Thread_phase phase;    /**< The phase of the thread */
 	int priority;
   void (*thread_func)();   /**< The function executed by this thread */
+  void* thread_arg;        /**< An argument for kernel threads, set before @c wakeup */
   Mutex state_spinlock;       /**< A spinlock for setting state and phase */
   /* scheduler data */  
   rlnode sched_node;      /**< node to use when queueing in the scheduler list */
@@ -0,0 +1,81 @@
+
+#include <string.h>
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+/*
+	Shared memory segments.
+
+	A segment is a stream whose memory is handed out by ShmMap. All
+	processes of the simulator share one address space, so mapping a
+	segment just returns its address. The segment is freed by the Close
+	method, when the last fid referring to it is closed.
+ */
+
+#define SHM_MAX_SIZE (1u<<30)
+
+typedef struct shm_control_block {
+	void* base;
+	uint size;
+} SHMCB;
+
+static int shm_close(void* this);
+
+file_ops ShmOps = {
+	.Open = NULL,
+	.Close = shm_close
+};
+
+
+static int shm_close(void* this)
+{
+	SHMCB* shm = (SHMCB*) this;
+	free(shm->base);
+	free(shm);
+	return 0;
+}
+
+
+Fid_t ShmCreate(unsigned int size)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(size == 0 || size > SHM_MAX_SIZE)
+		return NOFILE;
+
+	/* Allocate outside the kernel lock, it may take a while */
+	SHMCB* shm = (SHMCB*) xmalloc(sizeof(SHMCB));
+	shm->size = size;
+	shm->base = xmalloc(size);
+	memset(shm->base, 0, size);
+
+	Mutex_Lock(&kernel_mutex);
+	if(! FCB_reserve(1, &fid, &fcb)) {
+		Mutex_Unlock(&kernel_mutex);
+		free(shm->base);
+		free(shm);
+		return NOFILE;
+	}
+	FCB_setup(fcb, shm, &ShmOps);
+	Mutex_Unlock(&kernel_mutex);
+	return fid;
+}
+
+
+void* ShmMap(Fid_t fid, unsigned int* size)
+{
+	void* base = NULL;
+
+	Mutex_Lock(&kernel_mutex);
+	FCB* fcb = get_fcb(fid);
+	if(fcb && fcb->streamfunc == &ShmOps) {
+		SHMCB* shm = (SHMCB*) fcb->streamobj;
+		base = shm->base;
+		if(size) *size = shm->size;
+	}
+	Mutex_Unlock(&kernel_mutex);
+	return base;
+}
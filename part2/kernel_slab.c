@@ -0,0 +1,191 @@
+#include "kernel_slab.h"
+#include "kernel_cc.h"
+#include "util.h"
+
+/*
+	The list of caches in use, for statistics.
+ */
+static kmem_cache* kmem_caches = NULL;
+static Mutex kmem_caches_lock = MUTEX_INIT;
+
+
+static inline void* mag_pop(kmem_magazine* m)
+{
+	return m->objs[--m->rounds];
+}
+
+static inline void mag_push(kmem_magazine* m, void* obj)
+{
+	m->objs[m->rounds++] = obj;
+}
+
+static kmem_magazine* mag_new()
+{
+	kmem_magazine* m = (kmem_magazine*) xmalloc(sizeof(kmem_magazine));
+	m->next = NULL;
+	m->rounds = 0;
+	return m;
+}
+
+/* Depot lists, called with the cache lock held */
+static inline void depot_push(kmem_magazine** list, kmem_magazine* m)
+{
+	m->next = *list;
+	*list = m;
+}
+
+static inline kmem_magazine* depot_pop(kmem_magazine** list)
+{
+	kmem_magazine* m = *list;
+	if(m) *list = m->next;
+	return m;
+}
+
+
+static void kmem_cache_register(kmem_cache* cache)
+{
+	Mutex_Lock(&kmem_caches_lock);
+	if(! cache->registered) {
+		cache->registered = 1;
+		cache->next_cache = kmem_caches;
+		kmem_caches = cache;
+	}
+	Mutex_Unlock(&kmem_caches_lock);
+}
+
+
+/*
+	Allocate a new slab. One object is returned, and the rest are loaded
+	into a magazine which replaces the (empty) loaded magazine of the core.
+ */
+static void* kmem_cache_grow(kmem_cache* cache, kmem_cpu_cache* cpu)
+{
+	size_t size = (cache->size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	uint n = KMEM_SLAB_BYTES / size;
+	if(n < 1) n = 1;
+	if(n > KMEM_MAGAZINE_SIZE+1) n = KMEM_MAGAZINE_SIZE+1;
+
+	char* slab = (char*) xmalloc(n * size);
+
+	Mutex_Lock(&cache->lock);
+	cache->slabs++;
+	cache->objects += n;
+	kmem_magazine* m = (n>1) ? depot_pop(&cache->empty) : NULL;
+	if(cpu->loaded && n>1)
+		depot_push(&cache->empty, cpu->loaded);
+	Mutex_Unlock(&cache->lock);
+
+	if(! cache->registered)
+		kmem_cache_register(cache);
+
+	if(n>1) {
+		if(m==NULL) m = mag_new();
+		for(uint i=1; i<n; i++)
+			mag_push(m, slab + i*size);
+		cpu->loaded = m;
+	}
+	return slab;
+}
+
+
+void* kmem_cache_alloc(kmem_cache* cache)
+{
+	void* obj;
+
+	/* The per-core magazines are only accessed with preemption off */
+	int pre = preempt_off;
+	kmem_cpu_cache* cpu = & cache->cpu[cpu_core_id];
+
+	if(cpu->loaded && cpu->loaded->rounds > 0) {
+		obj = mag_pop(cpu->loaded);
+	}
+	else if(cpu->previous && cpu->previous->rounds > 0) {
+		kmem_magazine* m = cpu->previous;
+		cpu->previous = cpu->loaded;
+		cpu->loaded = m;
+		obj = mag_pop(m);
+	}
+	else {
+		/* Both magazines are empty (or missing): go to the depot */
+		cpu->misses++;
+		Mutex_Lock(&cache->lock);
+		kmem_magazine* m = depot_pop(&cache->full);
+		if(m) {
+			if(cpu->previous) depot_push(&cache->empty, cpu->previous);
+			cpu->previous = cpu->loaded;
+			cpu->loaded = m;
+		}
+		Mutex_Unlock(&cache->lock);
+
+		obj = m ? mag_pop(m) : kmem_cache_grow(cache, cpu);
+	}
+
+	cpu->allocs++;
+	if(pre) preempt_on;
+	return obj;
+}
+
+
+void kmem_cache_free(kmem_cache* cache, void* obj)
+{
+	if(obj == NULL) return;
+
+	int pre = preempt_off;
+	kmem_cpu_cache* cpu = & cache->cpu[cpu_core_id];
+
+	if(cpu->loaded && cpu->loaded->rounds < KMEM_MAGAZINE_SIZE) {
+		mag_push(cpu->loaded, obj);
+	}
+	else if(cpu->previous && cpu->previous->rounds == 0) {
+		kmem_magazine* m = cpu->previous;
+		cpu->previous = cpu->loaded;
+		cpu->loaded = m;
+		mag_push(m, obj);
+	}
+	else {
+		/* Both magazines are full (or missing): go to the depot */
+		cpu->misses++;
+		Mutex_Lock(&cache->lock);
+		if(cpu->previous) depot_push(&cache->full, cpu->previous);
+		kmem_magazine* m = depot_pop(&cache->empty);
+		Mutex_Unlock(&cache->lock);
+
+		if(m == NULL) m = mag_new();
+		cpu->previous = cpu->loaded;
+		cpu->loaded = m;
+		mag_push(m, obj);
+	}
+
+	cpu->frees++;
+	if(pre) preempt_on;
+}
+
+
+void kmem_cache_stats(kmem_cache* cache, kmem_stats* stats)
+{
+	stats->name = cache->name;
+	stats->size = cache->size;
+	stats->allocs = stats->frees = stats->misses = 0;
+	for(uint i=0; i<MAX_CORES; i++) {
+		stats->allocs += cache->cpu[i].allocs;
+		stats->frees += cache->cpu[i].frees;
+		stats->misses += cache->cpu[i].misses;
+	}
+	stats->in_use = stats->allocs - stats->frees;
+	stats->slabs = cache->slabs;
+	stats->objects = cache->objects;
+}
+
+
+uint kmem_all_stats(kmem_stats* stats, uint n)
+{
+	uint count = 0;
+	Mutex_Lock(&kmem_caches_lock);
+	for(kmem_cache* c = kmem_caches; c != NULL; c = c->next_cache) {
+		if(count < n)
+			kmem_cache_stats(c, &stats[count]);
+		count++;
+	}
+	Mutex_Unlock(&kmem_caches_lock);
+	return count;
+}
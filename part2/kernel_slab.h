@@ -0,0 +1,129 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+
+#include "tinyos.h"
+#include "bios.h"
+
+/**
+	@file kernel_slab.h
+	@brief Object caches for kernel objects.
+
+	@defgroup slab Object caches.
+	@ingroup kernel
+	@brief Object caches for kernel objects.
+
+	Kernel objects which are created and destroyed frequently (pipe control
+	blocks and pages, sockets, thread control blocks, etc) are allocated from
+	typed object caches, instead of @c malloc.
+
+	Each cache keeps, for each core, two magazines (small stacks of free
+	objects). Allocation and release of objects normally only touch the
+	magazines of the current core, without any lock. When both magazines
+	of a core are empty (full), a full (empty) magazine is exchanged with
+	the depot of the cache, under the cache lock. Only when the depot has no
+	full magazines, a new slab of objects is allocated.
+
+	Objects are never returned to @c malloc; a cache grows up to the peak
+	number of objects in use.
+
+	A cache is defined statically, e.g.,
+	@code
+	static kmem_cache picb_cache = KMEM_CACHE_INIT("PICB", PICB);
+	@endcode
+	and needs no further initialization.
+
+	@{
+*/
+
+/** @brief Number of objects held by a magazine. */
+#define KMEM_MAGAZINE_SIZE 16
+
+/** @brief Size of the memory allocated for a new slab of objects. */
+#define KMEM_SLAB_BYTES (16*1024)
+
+/** @brief A magazine of free objects. */
+typedef struct kmem_magazine {
+	struct kmem_magazine* next;		/**< @brief Link in the depot */
+	uint rounds;					/**< @brief Number of objects held */
+	void* objs[KMEM_MAGAZINE_SIZE];	/**< @brief The objects */
+} kmem_magazine;
+
+/** @brief The per-core part of a cache. */
+typedef struct kmem_cpu_cache {
+	kmem_magazine* loaded;		/**< @brief The magazine in use */
+	kmem_magazine* previous;	/**< @brief A full or empty magazine */
+	unsigned long allocs;		/**< @brief Allocations on this core */
+	unsigned long frees;		/**< @brief Releases on this core */
+	unsigned long misses;		/**< @brief Operations that went to the depot */
+} __attribute__((aligned(64))) kmem_cpu_cache;
+
+/** @brief An object cache. */
+typedef struct kmem_cache {
+	const char* name;			/**< @brief Name, for statistics */
+	size_t size;				/**< @brief Object size */
+
+	Mutex lock;					/**< @brief Protects the depot */
+	kmem_magazine* full;		/**< @brief Depot of full magazines */
+	kmem_magazine* empty;		/**< @brief Depot of empty magazines */
+	unsigned long slabs;		/**< @brief Number of slabs allocated */
+	unsigned long objects;		/**< @brief Number of objects allocated in slabs */
+
+	int registered;				/**< @brief True if in the list of caches */
+	struct kmem_cache* next_cache;	/**< @brief The list of caches */
+
+	kmem_cpu_cache cpu[MAX_CORES];	/**< @brief Per-core magazines */
+} kmem_cache;
+
+/** @brief Static initializer for a cache of objects of the given type. */
+#define KMEM_CACHE_INIT(cname, type) { .name = (cname), .size = sizeof(type), .lock = MUTEX_INIT }
+
+
+/**
+	@brief Allocate an object from a cache.
+
+	The object is not initialized. This function does not fail.
+*/
+void* kmem_cache_alloc(kmem_cache* cache);
+
+/**
+	@brief Return an object to its cache.
+
+	The object may have been allocated on a different core.
+	Freeing @c NULL does nothing.
+*/
+void kmem_cache_free(kmem_cache* cache, void* obj);
+
+
+/** @brief Allocation statistics of a cache. */
+typedef struct kmem_stats {
+	const char* name;			/**< @brief Cache name */
+	size_t size;				/**< @brief Object size */
+	unsigned long allocs;		/**< @brief Total allocations */
+	unsigned long frees;		/**< @brief Total releases */
+	unsigned long in_use;		/**< @brief Objects currently allocated */
+	unsigned long misses;		/**< @brief Allocations and releases that went to the depot */
+	unsigned long slabs;		/**< @brief Slabs allocated */
+	unsigned long objects;		/**< @brief Objects in all slabs */
+} kmem_stats;
+
+/**
+	@brief Get the statistics of a cache.
+
+	The per-core counters are read without synchronization, therefore
+	the statistics are approximate while the cache is in use.
+*/
+void kmem_cache_stats(kmem_cache* cache, kmem_stats* stats);
+
+/**
+	@brief Get the statistics of all caches in use.
+
+	Caches are listed after their first slab is allocated. The statistics
+	of up to @c n caches are stored in @c stats.
+
+	@returns the number of caches in use.
+*/
+uint kmem_all_stats(kmem_stats* stats, uint n);
+
+/** @} */
+
+#endif
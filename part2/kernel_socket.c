@@ -3,6 +3,9 @@
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_slab.h"
+
+static kmem_cache socb_cache = KMEM_CACHE_INIT("SOCB", SOCB);
 
 
 file_ops SocketOpsListener = {
@@ -20,6 +23,20 @@ file_ops SocketOpsPeer = {
 };
 
 
+/*
+	The socket of a file id, or NULL. Called with kernel_mutex held.
+	get_fcb checks the range of the fid against the fid table. Socket
+	FCBs are not set up with file_ops, so any other stream is rejected.
+ */
+static SOCB* get_socket(Fid_t fid)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL || fcb->streamfunc != NULL)
+		return NULL;
+	return (SOCB*)fcb->streamobj;
+}
+
+
 Fid_t Socket(port_t port) 
 {	
 	Mutex_Lock(&kernel_mutex);
@@ -40,7 +57,7 @@ Fid_t Socket(port_t port)
 		return NOFILE;
 	}
 
-	socket = (SOCB*)xmalloc(sizeof(SOCB));	
+	socket = (SOCB*)kmem_cache_alloc(&socb_cache);	
 	socket->port = port;
 	socket->type = UNBOUND;
 	socket->fid = myfid;
@@ -61,13 +78,7 @@ Fid_t Socket(port_t port)
 int Listen(Fid_t sock)
 {
 	Mutex_Lock(&kernel_mutex);
-	if(sock < 0 || sock >= MAX_FILEID)
-	{
-		Mutex_Unlock(&kernel_mutex);
-		return -1;
-	}
-	FCB* fcb = get_fcb(sock);
-	SOCB* socket = (SOCB*)fcb->streamobj;
+	SOCB* socket = get_socket(sock);
 	if(socket==NULL){
 		Mutex_Unlock(&kernel_mutex);
 		return -1;
@@ -87,7 +98,7 @@ int Listen(Fid_t sock)
 			}
 			else{
 				PCB* pcb = get_pcb(PortTable[i].listener->pid);
-				FCB* temp = pcb->FIDT[PortTable[i].listener->fid];				
+				FCB* temp = fidt_get(&pcb->FIDT, PortTable[i].listener->fid);				
 				if( temp->check == -1){
 					Mutex_Unlock(&kernel_mutex);
 					return -1;
@@ -112,13 +123,7 @@ Fid_t Accept(Fid_t lsock)
 	//	- the available file ids for the process are exhausted
 	//	- while waiting, the listening socket @c lsock was closed
 	Mutex_Lock(&kernel_mutex);
-	if(lsock<0 || lsock>=MAX_FILEID)
-	{
-		Mutex_Unlock(&kernel_mutex);
-		return -1;
-	}
-	FCB* fcb = get_fcb(lsock);
-	SOCB* lsocket = (SOCB*)fcb->streamobj;	
+	SOCB* lsocket = get_socket(lsock);
 	if(lsocket==NULL){
 		Mutex_Unlock(&kernel_mutex);
 		return -1;
@@ -143,10 +148,6 @@ Fid_t Accept(Fid_t lsock)
 	socket->receiver->read = get_fcb(pipe.read);
 	socket->receiver->write = get_fcb(pipe.write);
 //=======================================================
-	if(fcb==NULL){
-		Mutex_Unlock(&kernel_mutex);
-		return -1;	
-	}
 
 	Fid_t socketfid_t;	
 	SOCB* peerlistener;
@@ -154,7 +155,11 @@ Fid_t Accept(Fid_t lsock)
 		Mutex_Unlock(&kernel_mutex);
 		socketfid_t = Socket(lsocket->port);
 		Mutex_Lock(&kernel_mutex);	
-	  	peerlistener = (SOCB*)get_fcb(socketfid_t)->streamobj;
+	  	peerlistener = get_socket(socketfid_t);
+		if(peerlistener==NULL){
+			Mutex_Unlock(&kernel_mutex);
+			return -1;
+		}
 		peerlistener->type = LISTENERPEER;
 	}
 	else{	
@@ -181,14 +186,7 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
 	Mutex_Lock(&kernel_mutex);
 
-	FCB* fcb = get_fcb(sock);
-	SOCB* peer = (SOCB*)fcb->streamobj;
-
-	if(sock<0 || sock>=MAX_FILEID)
-	{
-		Mutex_Unlock(&kernel_mutex);
-		return -1;
-	}	
+	SOCB* peer = get_socket(sock);
 	if(peer==NULL){
 		Mutex_Unlock(&kernel_mutex);
 		return -1;
@@ -250,13 +248,8 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout)
 int ShutDown(Fid_t sock, shutdown_mode how)
 {
 	Mutex_Lock(&kernel_mutex);
-	if(sock<0 || sock >= MAX_FILEID){
-		Mutex_Unlock(&kernel_mutex);		
-		return -1;
-	}
-	FCB* fcb = get_fcb(sock);
-	SOCB* socket = (SOCB*)fcb->streamobj;
-	if(fcb ==NULL || socket->type == UNBOUND){
+	SOCB* socket = get_socket(sock);
+	if(socket==NULL || socket->type == UNBOUND){
 		Mutex_Unlock(&kernel_mutex);
 		return  -1;	
 	}
@@ -273,7 +266,7 @@ int ShutDown(Fid_t sock, shutdown_mode how)
 			release_FCB(socket->sender->write);
 			release_FCB(socket->receiver->read);	
 			release_FCB(socket->receiver->write);			
-			free(socket);
+			kmem_cache_free(&socb_cache, socket);
 			break;
 	}
 	Mutex_Unlock(&kernel_mutex);
@@ -1,27 +1,26 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_slab.h"
 
-#define MAX_FILES MAX_PROC
+/* The size of a new fid table; tables grow by doubling */
+#define FIDT_INITIAL_SIZE 16
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+/*
+  FCBs come from an object cache, so that each core opens and closes
+  streams from its own magazines, without kernel_mutex.
+ */
+static kmem_cache fcb_cache = KMEM_CACHE_INIT("FCB", FCB);
 
 
 void initialize_files()
 {
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
-    FT[i].id = i;
-		FT[i].check = -1;
-  }
+  /* fcb_cache needs no initialization */
 }
 
 
@@ -36,66 +35,184 @@ void initializePortTable(){
 
 
 
+/*
+  FCBs are never returned to malloc, only recycled by fcb_cache, so a
+  pointer to an FCB remains valid to dereference even after the stream
+  is closed. This is what
+  allows FCB_lookup to read the fid tables without kernel_mutex.
+  An FCB is not visible to FCB_lookup until it is set up by FCB_setup.
+ */
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
-  }
-  else
-    return NULL;
+  FCB* fcb = (FCB*) kmem_cache_alloc(& fcb_cache);
+  fcb->refcount = 0;
+  fcb->flags = 0;
+  fcb->streamobj = NULL;
+  fcb->streamfunc = NULL;
+  rlnode_init(&fcb->watchers, NULL);
+  fcb->check = -1;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  kmem_cache_free(& fcb_cache, fcb);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  int x = fcb->refcount + 1;
-	fcb->refcount = x;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Close the stream of an FCB with no references, with kernel_mutex held */
+static int FCB_close(FCB* fcb)
+{
+  int retval = 0;
+  /* An FCB may be dropped before it is set up */
+  if(fcb->streamfunc)
+    retval = fcb->streamfunc->Close(fcb->streamobj);
+  release_FCB(fcb);
+  return retval;
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
-    release_FCB(fcb);
-    return retval;
-  }
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_SEQ_CST)==0)
+    return FCB_close(fcb);
   else
     return 0;
 }
 
+void FCB_put(FCB* fcb)
+{
+  assert(fcb);
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_SEQ_CST)==0) {
+    Mutex_Lock(&kernel_mutex);
+    FCB_close(fcb);
+    Mutex_Unlock(&kernel_mutex);
+  }
+}
+
+void FCB_setup(FCB* fcb, void* streamobj, file_ops* streamfunc)
+{
+  fcb->streamobj = streamobj;
+  /* Publish the stream object with the methods */
+  __atomic_store_n(&fcb->streamfunc, streamfunc, __ATOMIC_RELEASE);
+}
+
 FCB* get_fcb_proc(Fid_t fid,Pid_t pid){
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
   PCB* pcb = get_pcb(pid);
-	return pcb->FIDT[fid];
+	return fidt_get(&pcb->FIDT, fid);
+}
+
+
+/*
+ *
+ *   Fid tables
+ *
+ */
+
+void fidt_init(fid_table* t)
+{
+  t->array = NULL;
+  t->used = NULL;
+  /* The words beyond the bitmap are never free */
+  t->full = (FIDT_WORDS < 64) ? ~((1ull << FIDT_WORDS) - 1) : 0;
+}
+
+void fidt_destroy(fid_table* t)
+{
+  fid_array* a = t->array;
+  while(a) {
+    fid_array* next = a->retired;
+    free(a);
+    a = next;
+  }
+  free(t->used);
+  fidt_init(t);
+}
+
+FCB* fidt_get(fid_table* t, Fid_t fid)
+{
+  fid_array* a = __atomic_load_n(&t->array, __ATOMIC_ACQUIRE);
+  if(a == NULL || fid < 0 || fid >= a->size) return NULL;
+  return __atomic_load_n(&a->slot[fid], __ATOMIC_ACQUIRE);
+}
+
+/* Make room for the fid, replacing the array by a larger copy */
+static void fidt_grow(fid_table* t, Fid_t fid)
+{
+  fid_array* old = t->array;
+  uint size = old ? old->size : 0;
+  if(fid < size) return;
+
+  uint newsize = size ? size : FIDT_INITIAL_SIZE;
+  while(newsize <= fid) newsize *= 2;
+  if(newsize > MAX_FILEID) newsize = MAX_FILEID;
+
+  fid_array* a = (fid_array*) xmalloc(sizeof(fid_array) + newsize*sizeof(FCB*));
+  a->size = newsize;
+  a->retired = old;
+  for(uint i=0; i<newsize; i++)
+    a->slot[i] = (i<size) ? old->slot[i] : NULL;
+
+  if(t->used == NULL) {
+    t->used = (uint64_t*) xmalloc(FIDT_WORDS*sizeof(uint64_t));
+    for(uint w=0; w<FIDT_WORDS; w++) t->used[w] = 0;
+  }
+
+  /* Lock-free readers see either the old or the new array */
+  __atomic_store_n(&t->array, a, __ATOMIC_RELEASE);
+}
+
+static inline void fidt_mark(fid_table* t, Fid_t fid, int used)
+{
+  uint w = fid / 64;
+  uint64_t bit = 1ull << (fid % 64);
+  if(used) t->used[w] |= bit; else t->used[w] &= ~bit;
+  if(~t->used[w] == 0) t->full |= 1ull << w; else t->full &= ~(1ull << w);
+}
+
+void fidt_set(fid_table* t, Fid_t fid, FCB* fcb)
+{
+  assert(fid >= 0 && fid < MAX_FILEID);
+  if(fcb == NULL && fid >= fidt_size(t)) return;
+  fidt_grow(t, fid);
+  __atomic_store_n(&t->array->slot[fid], fcb, __ATOMIC_RELEASE);
+  fidt_mark(t, fid, fcb != NULL);
+}
+
+Fid_t fidt_alloc(fid_table* t)
+{
+  if(~t->full == 0) return NOFILE;
+  uint w = __builtin_ctzll(~t->full);
+  uint64_t word = t->used ? t->used[w] : 0;
+  Fid_t fid = w*64 + __builtin_ctzll(~word);
+  if(fid >= MAX_FILEID) return NOFILE;
+
+  fidt_grow(t, fid);
+  fidt_mark(t, fid, 1);
+  return fid;
 }
 
 FCB* socketFCB_reserve(Fid_t *fid)
 {
 	FCB* fcb;
   PCB* cur = CURPROC;
-  size_t f=0;
 
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL){
-	    f++;
-	}
-	if(f==MAX_FILEID) {return NULL;}
+	Fid_t f = fidt_alloc(&cur->FIDT);
+	if(f==NOFILE) {return NULL;}
 	*fid = f;
  	fcb = acquire_FCB();
 	if(fcb == NULL){
-		release_FCB(fcb);
+		fidt_set(&cur->FIDT, f, NULL);
 		return NULL;
 	}
-	cur->FIDT[f]=fcb;
+	fidt_set(&cur->FIDT, f, fcb);
 	fcb->streamobj = NULL;
 //////////////////////FUCK LOGIC //////////////////////////////////// INCREF CRASHES ...
 	int x = fcb->refcount++;
@@ -107,35 +224,32 @@ FCB* socketFCB_reserve(Fid_t *fid)
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
     uint i;
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
-    }
-    if(i<num) return 0;
+    /* Find distinct fids, the lowest free ones */
+    for(i=0; i<num; i++)
+	if((fid[i] = fidt_alloc(&cur->FIDT)) == NOFILE)
+	    goto unfid;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
-	    break;
-    if(i<num) {
-	/* Roll back */
-	while(i>0) {
-	    release_FCB(fcb[i-1]);
-	    i--;
-	}
-	return 0;
-    }
+	    goto unfcb;
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
+	fidt_set(&cur->FIDT, fid[i], fcb[i]);
     }
     return 1;
+
+    /* Roll back */
+unfcb:
+    while(i>0)
+	release_FCB(fcb[--i]);
+    i = num;
+unfid:
+    while(i>0)
+	fidt_set(&cur->FIDT, fid[--i], NULL);
+    return 0;
 }
 
 
@@ -144,9 +258,11 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	assert(fidt_get(&cur->FIDT, fid[i])==fcb[i]);
+	fidt_set(&cur->FIDT, fid[i], NULL);
+	/* A racing FCB_lookup may hold a reference; it will release the FCB */
+	if(__atomic_sub_fetch(&fcb[i]->refcount, 1, __ATOMIC_SEQ_CST)==0)
+	    release_FCB(fcb[i]);
     }
 }
 
@@ -159,130 +275,335 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
-  return CURPROC->FIDT[fid];
+  return fidt_get(&CURPROC->FIDT, fid);
+}
+
+
+/* Take a reference, unless the FCB has been released */
+static inline int FCB_tryref(FCB* fcb)
+{
+  int r = __atomic_load_n(&fcb->refcount, __ATOMIC_SEQ_CST);
+  do {
+    if(r <= 0) return 0;
+  } while(! __atomic_compare_exchange_n(&fcb->refcount, &r, r+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+  return 1;
+}
+
+/*
+  The fid table is read without locks. The FCB found may be closed, 
+  and even recycled, concurrently; this is harmless, since FCBs are
+  never freed. Once a reference is taken, the FCB cannot be recycled, 
+  so it is enough to check that the fid still refers to it, and that it 
+  has been set up. When the check fails, we fall back to kernel_mutex.
+ */
+FCB* FCB_lookup(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  fid_table* t = & CURPROC->FIDT;
+
+  FCB* fcb = fidt_get(t, fid);
+  if(fcb == NULL) return NULL;
+
+  if(FCB_tryref(fcb)) {
+    if(fidt_get(t, fid) == fcb
+       && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) != NULL)
+      return fcb;
+    FCB_put(fcb);
+  }
+
+  Mutex_Lock(&kernel_mutex);
+  fcb = get_fcb(fid);
+  if(fcb && fcb->streamfunc)
+    FCB_incref(fcb);
+  else
+    fcb = NULL;
+  Mutex_Unlock(&kernel_mutex);
+  return fcb;
+}
+
+
+/*
+  True if an I/O call on a non-blocking stream would have to wait
+  for one of the given events. A hung up or failed stream does not
+  block, the call will return at once.
+
+  This is only a hint, since another thread may take the data (space)
+  before the call; it is used for streams whose methods cannot be told
+  not to block (see file_ops).
+ */
+static int would_block(FCB* fcb, uint events)
+{
+  if(! (fcb->flags & FID_NONBLOCK)) return 0;
+  return ! (stream_poll(fcb, NULL) & (events|POLL_HANGUP|POLL_ERROR));
 }
 
 
 int Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  Mutex_Lock(&kernel_mutex);
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! No lock is taken. */
+  FCB* fcb = FCB_lookup(fd);
+
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    file_ops* ops = fcb->streamfunc;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    /* We must not go into non-preemptive domain with kernel_mutex locked */
-    Mutex_Unlock(&kernel_mutex);  
+    if((fcb->flags & FID_NONBLOCK) && ops->ReadV) {
+      iovec_t iov = { buf, size };
+      retcode = ops->ReadV(fcb->streamobj, &iov, 1, FID_NONBLOCK);
+    }
+    else if(ops->Read && ! would_block(fcb, POLL_READ))
+      retcode = ops->Read(fcb->streamobj, buf, size);
+
+    /* Need to decrease the reference to FCB */
+    FCB_put(fcb);
+  }
+
+  return retcode;
+}
+
+
+int Write(Fid_t fd, const char *buf, unsigned int size)
+{
+  int retcode = -1;
+
+  /* make sure that the stream will not be closed (by another thread) 
+     while we are using it! No lock is taken. */
+  FCB* fcb = FCB_lookup(fd);
+
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
 
-    if(devread)
-      retcode = devread(sobj, buf, size);
+    if((fcb->flags & FID_NONBLOCK) && ops->WriteV) {
+      iovec_t iov = { (void*)buf, size };
+      retcode = ops->WriteV(fcb->streamobj, &iov, 1, FID_NONBLOCK);
+    }
+    else if(ops->Write && ! would_block(fcb, POLL_WRITE))
+      retcode = ops->Write(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
-    Mutex_Lock(& kernel_mutex);
-    FCB_decref(fcb);
+    FCB_put(fcb);
+  }
+
+  return retcode;
+}
+
 
+/*
+  Fallbacks for streams without vectored operations.
+ */
+static int readv_fallback(file_ops* ops, void* sobj, const iovec_t* iov, uint iovcnt)
+{
+  /* A second Read might block after the first one returned data */
+  for(uint i=0; i<iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      return ops->Read ? ops->Read(sobj, iov[i].iov_base, iov[i].iov_len) : -1;
+  return 0;
+}
+
+static int writev_fallback(file_ops* ops, void* sobj, const iovec_t* iov, uint iovcnt)
+{
+  int count = 0;
+  if(ops->Write == NULL) return -1;
+  for(uint i=0; i<iovcnt; i++) {
+    if(iov[i].iov_len == 0) continue;
+    int rc = ops->Write(sobj, iov[i].iov_base, iov[i].iov_len);
+    if(rc < 0) return (count>0) ? count : rc;
+    count += rc;
+    if(rc < iov[i].iov_len) break;
   }
-  
-  Mutex_Unlock(&kernel_mutex);  
+  return count;
+}
+
+
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
 
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
+  if(iov == NULL && iovcnt > 0) return -1;
+
+  FCB* fcb = FCB_lookup(fd);
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    void* sobj = fcb->streamobj;
 
+    if(ops->ReadV)
+      retcode = ops->ReadV(sobj, iov, iovcnt, fcb->flags & FID_NONBLOCK);
+    else if(! would_block(fcb, POLL_READ))
+      retcode = readv_fallback(ops, sobj, iov, iovcnt);
+
+    FCB_put(fcb);
+  }
 
   return retcode;
 }
 
 
-int Write(Fid_t fd, const char *buf, unsigned int size)
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  Mutex_Lock(&kernel_mutex);
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  if(iov == NULL && iovcnt > 0) return -1;
 
+  FCB* fcb = FCB_lookup(fd);
   if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    void* sobj = fcb->streamobj;
 
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
+    if(ops->WriteV)
+      retcode = ops->WriteV(sobj, iov, iovcnt, fcb->flags & FID_NONBLOCK);
+    else if(! would_block(fcb, POLL_WRITE))
+      retcode = writev_fallback(ops, sobj, iov, iovcnt);
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    /* We must not go into non-preemptive domain with kernel_mutex locked */
-    Mutex_Unlock(&kernel_mutex);  
+    FCB_put(fcb);
+  }
 
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
-    /* Need to decrease the reference to FCB */
-    Mutex_Lock(& kernel_mutex);
-    FCB_decref(fcb);
+  return retcode;
+}
+
+
+/*
+  CopyStream moves the data through a buffer taken from a cache, so
+  that a core reuses the same few buffers for all copies.
+ */
+#define COPY_CHUNK_SIZE 4096
+
+typedef struct copy_buffer {
+  char data[COPY_CHUNK_SIZE];
+} copy_buffer;
+
+static kmem_cache copy_buffer_cache = KMEM_CACHE_INIT("copy_buffer", copy_buffer);
+
+/* Write all of buf, as the data has already been consumed from the input */
+static int write_fully(FCB* fcb, const char* buf, uint size)
+{
+  int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
+  uint count = 0;
+  while(count < size) {
+    int rc = devwrite(fcb->streamobj, buf+count, size-count);
+    if(rc <= 0) return -1;
+    count += rc;
+  }
+  return count;
+}
 
+/* Read a chunk, without blocking if the input is non-blocking */
+static int read_chunk(FCB* fcb, char* buf, uint size)
+{
+  file_ops* ops = fcb->streamfunc;
+  if((fcb->flags & FID_NONBLOCK) && ops->ReadV) {
+    iovec_t iov = { buf, size };
+    return ops->ReadV(fcb->streamobj, &iov, 1, FID_NONBLOCK);
   }
+  if(would_block(fcb, POLL_READ)) return -1;
+  return ops->Read(fcb->streamobj, buf, size);
+}
+
+static int copy_stream(FCB* in, FCB* out, uint n, uint flags)
+{
+  copy_buffer* cbuf = (copy_buffer*) kmem_cache_alloc(&copy_buffer_cache);
+  uint copied = 0;
+  int rc = 0;
+
+  while(copied < n) {
+    /* Do not consume input that cannot be written at once */
+    if(would_block(out, POLL_WRITE)) {
+      if(copied == 0) rc = -1;
+      break;
+    }
+
+    uint chunk = (n-copied < COPY_CHUNK_SIZE) ? n-copied : COPY_CHUNK_SIZE;
+    rc = read_chunk(in, cbuf->data, chunk);
+    if(rc <= 0) break;
+
+    rc = write_fully(out, cbuf->data, rc);
+    if(rc < 0) break;
+    copied += rc;
+
+    if(flags & COPY_ONCE) break;
+  }
+
+  kmem_cache_free(&copy_buffer_cache, cbuf);
+  return (copied>0 || rc>=0) ? (int)copied : -1;
+}
+
+
+int CopyStream(Fid_t fid_in, Fid_t fid_out, unsigned int n, unsigned int flags)
+{
+  int retcode = -1;
+
+  if(flags & ~COPY_ONCE) return -1;
+  if(n > INT_MAX) n = INT_MAX;
 
-  Mutex_Unlock(& kernel_mutex);
+  FCB* in = FCB_lookup(fid_in);
+  FCB* out = FCB_lookup(fid_out);
 
+  if(in && out && in->streamfunc->Read && out->streamfunc->Write)
+    retcode = copy_stream(in, out, n, flags);
+
+  if(in) FCB_put(in);
+  if(out) FCB_put(out);
   return retcode;
 }
 
 
-int Close(int fd)
+/* Close, called with kernel_mutex held */
+int fid_close(Fid_t fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
-  Mutex_Lock(&kernel_mutex);
 
   FCB* fcb = get_fcb(fd);
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-if(CURPROC->FIDT[fd] == NULL){
-}
+    fidt_set(&CURPROC->FIDT, fd, NULL);
+    event_fid_closed(CURPROC, fd, fcb);
 	retcode = FCB_decref(fcb);    
   }
+  return retcode;
+}
 
+int Close(int fd)
+{
+  Mutex_Lock(&kernel_mutex);
+  int retcode = fid_close(fd);
   Mutex_Unlock(&kernel_mutex);  
   return retcode;
 }
 
 
-/*
-  Copy file descriptor oldfd into file descriptor newfd.
-
-  This call returns 0 on success and -1 on failure.
-  Possible reasons for failure:
-  - Either oldfd or newfd is invalid.
- */
-int Dup2(int oldfd, int newfd)
+/* Dup2, called with kernel_mutex held */
+int fid_dup2(Fid_t oldfd, Fid_t newfd)
 {
-  int retcode=0;
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
-  Mutex_Lock(&kernel_mutex);
 
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
-  if(old==NULL) {
-    retcode = -1;
-  }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+  if(old==NULL)
+    return -1;
+  if(old!=new) {
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_set(&CURPROC->FIDT, newfd, old);
+    if(new) {
+      event_fid_closed(CURPROC, newfd, new);
+      FCB_decref(new);
+    }
   }
+  return 0;
+}
 
+/*
+  Copy file descriptor oldfd into file descriptor newfd.
+
+  This call returns 0 on success and -1 on failure.
+  Possible reasons for failure:
+  - Either oldfd or newfd is invalid.
+ */
+int Dup2(int oldfd, int newfd)
+{
+  Mutex_Lock(&kernel_mutex);
+  int retcode = fid_dup2(oldfd, newfd);
   Mutex_Unlock(&kernel_mutex);  
   return retcode;
 }
@@ -308,10 +629,13 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  void* streamobj;
+  file_ops* streamfunc;
+  if(device_open(major, minor, &streamobj, &streamfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_setup(fcb, streamobj, streamfunc);
   
   goto finok;
 finerr:
@@ -333,3 +657,56 @@ Fid_t OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+int SetTerminalMode(Fid_t fid, unsigned int mode)
+{
+  int retcode = -1;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fcb = get_fcb(fid);
+  if(fcb) {
+    FCB_incref(fcb);
+
+    /* We must not go into non-preemptive domain with kernel_mutex locked */
+    Mutex_Unlock(&kernel_mutex);
+    retcode = serial_set_mode(fcb->streamfunc, fcb->streamobj, mode);
+    Mutex_Lock(&kernel_mutex);
+
+    FCB_decref(fcb);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+int SetFidFlags(Fid_t fid, unsigned int flags)
+{
+  int retcode = -1;
+
+  flags &= ~FID_TERMINAL;
+  if(flags & ~FID_NONBLOCK) return -1;
+
+  Mutex_Lock(&kernel_mutex);
+  FCB* fcb = get_fcb(fid);
+  if(fcb) {
+    fcb->flags = flags;
+    retcode = 0;
+  }
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+int GetFidFlags(Fid_t fid)
+{
+  int retcode = -1;
+
+  Mutex_Lock(&kernel_mutex);
+  FCB* fcb = get_fcb(fid);
+  if(fcb)
+    retcode = fcb->flags | (is_serial_stream(fcb->streamfunc) ? FID_TERMINAL : 0);
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
@@ -40,30 +40,81 @@
  */
 typedef struct file_control_block
 {
-  int refcount;  			/**< @brief Reference counter. */
+  int refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
-  rlnode freelist_node;		/**< @brief Intrusive list node */
-	int id;
+  uint flags;				/**< @brief The fid flags, e.g., FID_NONBLOCK */
+  rlnode watchers;			/**< @brief Event queue items of the stream, under @c kernel_mutex */
 	int check;
 } FCB;
 //=============================================================================
+/*
+	The pipe buffer is a chain of pages, from the reader's head page to the
+	writer's tail page. Pages are allocated by the writer as the backlog grows, 
+	up to the limit of the pipe, and released by the reader as they are 
+	consumed, so that an idle pipe holds at most a page or two.
+
+	Data moves through the pages without locks: the writer only touches 
+	the tail page, the reader only touches the pages with released data, 
+	and the two synchronize on the atomic data count. The reader_lock and 
+	writer_lock only serialize multiple readers (writers) among themselves, 
+	so that each side of the buffer has a single user at a time. 
+	The wait_lock and condition variables are only touched when the buffer 
+	becomes non-empty or crosses a watermark, or when one of the ends is 
+	closed.
+
+	The wait_lock and the lock of the poll_queue are spinlocks, taken with
+	preemption off for short sections which never sleep. They always nest 
+	below kernel_mutex (see kernel_poll.c), so wakeups may be issued with 
+	kernel_mutex held, as the Close methods and PipeSetWatermarks do. 
+	Only calls which may sleep on the pipe release kernel_mutex first.
+ */
+#define PIPE_PAGE_SIZE 4096
+#define PIPE_DEFAULT_LIMIT (64*1024)
+#define PIPE_MAX_LIMIT (1024*1024)
+#define PIPE_LOW_MARK_DELAY 10	/* ms a reader waits for the low mark */
+
+typedef struct pipe_page {
+	struct pipe_page* next;
+	char data[PIPE_PAGE_SIZE];
+} pipe_page;
+
 typedef struct pipe_control_block{
 	FCB* read;
 	FCB* write;
-	io_buffer* buffer;
+	pipe_page* head;	/* reader side */
+	uint rpos;
+	pipe_page* tail;	/* writer side */
+	uint wpos;
+	pipe_page* spare;	/* a consumed page, kept for the writer */
+	uint data;			/* bytes available to the reader */
+	uint limit;			/* maximum number of bytes buffered */
+	uint flags;			/* PIPE_MESSAGE */
+	int writers_waiting;	/* message mode writers waiting for space */
+	Mutex reader_lock;
+	Mutex writer_lock;
+	Mutex wait_lock;
 	CondVar reader_var;
 	CondVar writer_var;
-	uint reader_pointer;
-	uint writer_pointer;
+	int reader_closed;
+	int writer_closed;
+	uint low_mark;		/* readers are woken when data reaches this */
+	long pending_since;	/* when data last arrived in an empty pipe */
+	uint high_mark;		/* writers are woken when data drains to this */
+	wait_queue poll_queue;	/* pollers of either end */
 
 } PICB;
 
 int pipe_illegal_call_reader(void* this,char* buf,uint size);
 int pipe_illegal_call_writer(void* this,const char* buf,uint size);
-int pipe_close(void* pipe);
+int pipe_reader_close(void* pipe);
+int pipe_writer_close(void* pipe);
 int pipe_read(void* this, char* buf, uint bufsize);
 int pipe_write(void* this,const char* buf,uint size);
+int pipe_readv(void* this, const iovec_t* iov, uint iovcnt, uint flags);
+int pipe_writev(void* this, const iovec_t* iov, uint iovcnt, uint flags);
+uint pipe_reader_poll(void* this, poll_table* pt);
+uint pipe_writer_poll(void* this, poll_table* pt);
 FCB* socketFCB_reserve(Fid_t *fid);
 
 
@@ -149,6 +200,30 @@ void FCB_incref(FCB* fcb);
 int FCB_decref(FCB* fcb);
 
 
+/**
+	@brief Decrease the reference count of the fcb, without @c kernel_mutex.
+
+	This is @ref FCB_decref for callers which do not hold @c kernel_mutex.
+	The lock is taken only if the stream has to be closed.
+
+	@param fcb  the fcb whose reference count is decreased
+*/
+void FCB_put(FCB* fcb);
+
+
+/**
+	@brief Set the stream of a reserved FCB.
+
+	The stream becomes visible to @ref FCB_lookup. This must be the last
+	step of the initialization of the stream.
+
+	@param fcb the fcb, returned by @ref FCB_reserve
+	@param streamobj the stream object
+	@param streamfunc the stream methods
+*/
+void FCB_setup(FCB* fcb, void* streamobj, file_ops* streamfunc);
+
+
 /** @brief Acquire a number of FCBs and corresponding fids.
 
    Given an array of fids and an array of pointers to FCBs  of
@@ -199,6 +274,50 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This routine does not need @c kernel_mutex, and normally does not
+	take it. The reference must be released by @ref FCB_put.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* FCB_lookup(Fid_t fid);
+
+
+/** @brief Close a file id, as in @c Close, called with @c kernel_mutex held. */
+int fid_close(Fid_t fd);
+
+
+/** @brief Copy a file id, as in @c Dup2, called with @c kernel_mutex held. */
+int fid_dup2(Fid_t oldfd, Fid_t newfd);
+
+
+struct process_control_block;
+
+/** @brief Remove a file id of a process from the event queues.
+
+	This is called with @c kernel_mutex held, whenever a file id is 
+	removed from the file table of a process, before its reference to
+	@c fcb is released. The event items of the file id are marked, 
+	and the event queues release them at their next use.
+ */
+void event_fid_closed(struct process_control_block* pcb, Fid_t fid, FCB* fcb);
+
+
+/** @brief Create a pipe, as in @c PipeEx, called with @c kernel_mutex held. */
+int pipe_create(pipe_t* pipe, uint flags);
+
+
+/** @brief Return the events ready on a stream.
+
+	This calls the @c Poll method of the stream, registering @c pt
+	if it is not NULL. Streams without a @c Poll method are always
+	ready for reading and writing.
+ */
+uint stream_poll(FCB* fcb, poll_table* pt);
+
+
 /** @} */
 
 #endif
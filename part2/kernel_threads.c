@@ -3,6 +3,9 @@
 #include "kernel_sched.h"
 #include "kernel_cc.h"//remove this
 #include "kernel_proc.h"
+#include "kernel_slab.h"
+
+static kmem_cache argst_cache = KMEM_CACHE_INIT("ARGST", ARGST);
 
 /** 
   @brief Create a new thread in the current process.
@@ -36,8 +39,11 @@ void start_any_thread(){
 	ARGST* argst = helper->args;
 	ptcb=argst->ptcb;	
 	Task task=argst->task;
+	int argl=argst->argl;
+	void* args=argst->args;
+	kmem_cache_free(&argst_cache, argst);
 
-	exitval = task(argst->argl,argst->args);
+	exitval = task(argl,args);
 	ptcb->exitval=exitval;		
 	ThreadExit(exitval);
 
@@ -52,10 +58,9 @@ Tid_t CreateThread(Task task, int argl, void* args)
 	TCB* tcb = NULL;
 	ARGST* argst;
 	PTCB* ptcb = NULL;
-	argst= (ARGST*)xmalloc(sizeof(ARGST));
-
-	rlnode_init(& argst->args_node, argst);
 	if(task!=NULL){
+		argst= (ARGST*)kmem_cache_alloc(&argst_cache);
+		rlnode_init(& argst->args_node, argst);
 		(argst)->task = task;
 		(argst)->argl = argl;
 		if(args!=NULL){
@@ -40,8 +40,9 @@ typedef int Pid_t;		/* The PID type  */
 typedef int Fid_t;  
 
 /** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
-#define MAX_FILEID 16
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors. 
+   The fid table of a process grows as needed, up to this size. */
+#define MAX_FILEID 4096
 
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
@@ -395,6 +396,38 @@ unsigned int GetTerminalDevices();
 Fid_t OpenTerminal(unsigned int termno);
 
 
+/** @brief Terminal line discipline flags.
+
+  @see SetTerminalMode
+ */
+typedef enum {
+  TERM_RAW = 0,     /**< Bytes are passed to readers as they arrive */
+  TERM_CANON = 1,   /**< Input is line-buffered, with erase and end-of-file handling */
+  TERM_ECHO = 2,    /**< Input is echoed back to the terminal */
+  TERM_COOKED = TERM_CANON|TERM_ECHO
+} term_mode;
+
+
+/** @brief Set the line discipline of a terminal.
+
+  The mode applies to the terminal device, and therefore to every stream 
+  open on it. Terminals start in @c TERM_RAW mode.
+
+  In @c TERM_CANON mode, a @c Read returns at most one line, and only
+  after the line has been completed by a newline. Before that, backspace 
+  (or DEL) erases the last byte of the line. A ctrl-D completes the
+  line without a newline; on an empty line, it makes the next @c Read 
+  return 0.
+
+  @param fid the file ID of a terminal stream
+  @param mode a combination of @c TERM_CANON and @c TERM_ECHO
+  @return 0 on success and -1 on error. Possible errors are:
+   - The file id is invalid, or not a terminal stream.
+   - The mode is invalid.
+ */
+int SetTerminalMode(Fid_t fid, unsigned int mode);
+
+
 /** @brief Open a stream on the null device.
 
   The null device is a virtual device representing an "infinite"
@@ -453,6 +486,81 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief A buffer segment, for vectored I/O.
+
+  @see ReadV
+  @see WriteV
+ */
+typedef struct iovec_s {
+  void* iov_base;           /**< Start of the segment */
+  unsigned int iov_len;     /**< Size of the segment in bytes */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into multiple buffers.
+
+  This call behaves like @c Read into a single buffer made of the 
+  @c iovcnt segments of @c iov, filled in order. It does a single
+  file id lookup and a single device call for all the segments.
+
+  @param fd  the file ID of the stream to read from
+  @param iov the array of segments
+  @param iovcnt the number of segments in @c iov
+  @return the number of bytes copied, 0 if we have reached EOF, or -1, 
+        indicating some error, as for @c Read.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from multiple buffers.
+
+  This call behaves like @c Write from a single buffer made of the 
+  @c iovcnt segments of @c iov, in order. It does a single file id 
+  lookup and a single device call for all the segments.
+
+  @param fd  the file ID of the stream to write to
+  @param iov the array of segments
+  @param iovcnt the number of segments in @c iov
+  @return the number of bytes copied, or -1 on error, as for @c Write.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Flags of @c CopyStream.
+
+  @see CopyStream
+ */
+typedef enum {
+  COPY_ONCE = 1     /**< Return after the first chunk */
+} copy_flags;
+
+
+/** @brief Copy bytes from one stream to another, inside the kernel.
+
+  This call is equivalent to a loop of @c Read from @c fid_in and
+  @c Write to @c fid_out, until @c n bytes have been copied or the
+  input reaches end of file. The data is copied in chunks through a
+  kernel buffer, and each chunk is written out completely, so a proxy 
+  needs one call per transfer instead of two per chunk. Unlike 
+  @c Splice, the input may be any readable stream.
+
+  With @c COPY_ONCE, the call returns after the first chunk, e.g., to
+  serve several streams with @c Poll. A non-blocking stream ends the
+  copy when it would block.
+
+  @param fid_in the file ID of the stream to read from
+  @param fid_out the file ID of the stream to write to
+  @param n the maximum number of bytes to copy
+  @param flags a combination of @c copy_flags
+  @return the number of bytes copied, 0 if the input has reached end of file,
+    or -1 on error, when no bytes have been copied. Possible reasons for error:
+    - @c fid_in is not a readable stream, or @c fid_out is not a writable stream.
+    - The flags are invalid.
+    - Reading or writing failed. A chunk which could not be written is lost.
+ */
+int CopyStream(Fid_t fid_in, Fid_t fid_out, unsigned int n, unsigned int flags);
+
+
 /** @brief Close a file id.
    
 
@@ -484,6 +592,49 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief File id flags.
+
+  @see SetFidFlags
+ */
+typedef enum {
+  FID_NONBLOCK = 1,   /**< I/O calls fail instead of blocking */
+  FID_TERMINAL = 2    /**< The stream is a terminal (read only) */
+} fid_flags;
+
+
+/** @brief Set the flags of a stream.
+
+  The flags belong to the stream, and are therefore shared by all
+  file ids which refer to it (e.g., after @c Dup2 or @c Exec).
+
+  When @c FID_NONBLOCK is set, a @c Read (@c Write) on a stream which 
+  has no data (no space) available returns -1 at once, instead of blocking.
+  Use @c Poll to wait until the stream is ready. Streams which cannot be 
+  polled are always considered ready.
+
+  The @c FID_TERMINAL flag cannot be changed, and is ignored.
+
+  @param fid the file id of the stream
+  @param flags a combination of @c fid_flags
+  @return 0 on success and -1 on error. Possible errors are:
+   - The file id is invalid.
+   - The flags are invalid.
+ */
+int SetFidFlags(Fid_t fid, unsigned int flags);
+
+
+/** @brief Return the flags of a stream.
+
+  Besides the flags set by @c SetFidFlags, the result contains
+  @c FID_TERMINAL if the stream is a terminal.
+
+  @param fid the file id of the stream
+  @return the flags of the stream, or -1 if the file id is invalid.
+  @see SetFidFlags
+ */
+int GetFidFlags(Fid_t fid);
+
 /*******************************************
  *
  * Pipes
@@ -511,9 +662,9 @@ typedef struct pipe_s {
 	@brief Construct and return a pipe.
 
 	A pipe is a one-directional buffer accessed via two file ids,
-	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	one for each end of the buffer. The buffer grows with the amount of
+	data buffered, up to the limit of the pipe (64 kbytes, unless changed 
+	by @c PipeSetLimit()). 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -527,6 +678,134 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Pipe modes, for @c PipeEx.
+*/
+enum pipe_mode {
+	PIPE_STREAM = 0,	/**< A byte stream, as returned by @c Pipe */
+	PIPE_MESSAGE = 1	/**< Writes are delivered as separate messages */
+};
+
+
+/**
+	@brief Construct and return a pipe, in the given mode.
+
+	With @c PIPE_STREAM, this is the same as @c Pipe().
+
+	With @c PIPE_MESSAGE, the pipe preserves record boundaries: each 
+	@c Write (or @c WriteV) of n>0 bytes is stored as one message, 
+	and is written completely or not at all (blocking until there is
+	room for it). Each @c Read returns exactly one message, in the order
+	written. If the message is longer than the buffer of @c Read, the rest
+	of the message is discarded. A @c Write of 0 bytes writes nothing.
+
+	Message pipes cannot be used with @c Splice, @c Tee or 
+	@c PipeSetWatermarks.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param flags the pipe mode
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+		- the mode is invalid.
+*/
+int PipeEx(pipe_t* pipe, unsigned int flags);
+
+
+/**
+	@brief Set the wakeup watermarks of a pipe.
+
+	By default, a reader blocked on an empty pipe is woken up as soon as
+	any data is written, and a writer blocked on a full pipe is woken up
+	as soon as any data is read. For pipes carrying many small writes, 
+	this costs a context switch per write.
+
+	With watermarks, a @c Read blocks until at least @c lo bytes are buffered 
+	(or the write end is closed), and a writer blocked on a full pipe sleeps 
+	until no more than @c hi bytes are buffered. Larger @c lo and smaller
+	@c hi batch more data per wakeup, at the cost of latency. The latency
+	is bounded: once data has been buffered for a few milliseconds, a 
+	@c Read returns it even if it is less than @c lo bytes, so a writer 
+	may stop below the low watermark without closing the pipe.
+
+	The watermarks apply to the pipe, and may be set through either end.
+
+	@param fid a file id of either end of a pipe
+	@param lo the low watermark, from 1 (the default) to the pipe limit
+	@param hi the high watermark, below the pipe limit (by default, 
+	   one less than the limit)
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the file id is not an end of a pipe.
+		- the watermarks are out of range.
+*/
+int PipeSetWatermarks(Fid_t fid, unsigned int lo, unsigned int hi);
+
+
+/**
+	@brief Set the maximum amount of data buffered in a pipe.
+
+	The pipe buffer is allocated in pages as data accumulates, and 
+	released as it is read, so a large limit only costs memory while
+	the reader lags behind. Watermarks that do not fit the new limit
+	are lowered to fit.
+
+	@param fid a file id of either end of a pipe
+	@param limit the new limit, between 4 kbytes and 1 Mbyte. In a message
+	   pipe, a message (plus 4 bytes) cannot exceed the limit; a writer
+	   waiting to write a message which no longer fits fails with -1.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the file id is not an end of a pipe.
+		- the limit is out of range.
+*/
+int PipeSetLimit(Fid_t fid, unsigned int limit);
+
+
+/**
+	@brief Move data from a pipe to another stream, inside the kernel.
+
+	This call is equivalent to a @c Read of up to @c n bytes from 
+	@c fid_in, followed by a @c Write of them to @c fid_out, except that 
+	the data is written to the output stream directly from the pipe
+	buffer, without a copy through user memory. The output may be
+	any writable stream, e.g., another pipe, a terminal or the null device.
+
+	Like @c Read, the call blocks until there is data in the pipe, and
+	it may move fewer than @c n bytes, e.g., when the output is full.
+
+	@param fid_in the read end of a pipe
+	@param fid_out a writable stream, other than the write end of the same pipe
+	@param n the maximum number of bytes to move
+	@returns the number of bytes moved, 0 if the pipe has reached end of file,
+	    or -1 on error. Possible reasons for error:
+		- @c fid_in is not the read end of a pipe.
+		- @c fid_out is not a writable stream.
+		- writing to @c fid_out failed.
+*/
+int Splice(Fid_t fid_in, Fid_t fid_out, unsigned int n);
+
+
+/**
+	@brief Duplicate the data of a pipe into another pipe, without consuming it.
+
+	Up to @c n bytes buffered in the pipe of @c fid_in are written to the
+	pipe of @c fid_out, and remain available to readers of @c fid_in.
+	Together with @c Splice, this allows fanning out a stream to two
+	consumers, without copying it through user memory.
+
+	The call blocks until there is data in the input pipe and space in
+	the output pipe, and it may duplicate fewer than @c n bytes.
+
+	@param fid_in the read end of a pipe
+	@param fid_out the write end of another pipe
+	@param n the maximum number of bytes to duplicate
+	@returns the number of bytes duplicated, 0 if the input pipe has reached 
+	    end of file, or -1 on error. Possible reasons for error:
+		- @c fid_in is not the read end of a pipe.
+		- @c fid_out is not the write end of another pipe.
+		- the read end of the output pipe is closed.
+*/
+int Tee(Fid_t fid_in, Fid_t fid_out, unsigned int n);
+
 /*******************************************
  *
  * Sockets (local)
@@ -698,6 +977,347 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Stream multiplexing
+ *
+ *******************************************/
+
+/** @brief Stream readiness events, for @c Poll. */
+typedef enum {
+  POLL_READ = 1,     /**< A @c Read will not block */
+  POLL_WRITE = 2,    /**< A @c Write will not block */
+  POLL_HANGUP = 4,   /**< The other end of the stream is closed (output only) */
+  POLL_ERROR = 8,    /**< A @c Write will fail (output only) */
+  POLL_INVALID = 16  /**< The file id is invalid (output only) */
+} poll_events;
+
+
+/**
+	@brief Wait until one of several streams is ready.
+
+	On entry, @c events[i] holds the events of interest for @c fids[i],
+	a combination of @c POLL_READ and @c POLL_WRITE. On return, @c events[i]
+	holds the events which are ready for @c fids[i]. @c POLL_HANGUP, @c POLL_ERROR 
+	and @c POLL_INVALID are always reported. Entries with a negative file id 
+	are ignored.
+
+	The call returns at once if some stream is ready, else it blocks until
+	one becomes ready, or the timeout expires.
+
+	@param fids the file ids to wait on
+	@param events the events of interest, and the events which are ready
+	@param n the number of entries in @c fids and @c events
+	@param timeout the maximum time to wait, in milliseconds; 0 does not 
+	   wait at all, and a negative timeout waits indefinitely
+	@returns the number of entries with non-zero @c events, 0 if the 
+	   timeout expired, or -1 on error. Possible reasons for error:
+	   - @c fids or @c events is NULL.
+*/
+int Poll(const Fid_t* fids, unsigned int* events, unsigned int n, timeout_t timeout);
+
+
+/** @brief Operations of @c EventCtl. */
+typedef enum {
+  EVENT_ADD = 1,    /**< Add a stream to the event queue */
+  EVENT_MOD = 2,    /**< Change the events of interest of a stream */
+  EVENT_DEL = 3     /**< Remove a stream from the event queue */
+} event_ctl_op;
+
+
+/** @brief A ready stream, as returned by @c EventWait. */
+typedef struct event_s {
+  Fid_t fid;              /**< The file id of the stream, as passed to @c EventCtl */
+  unsigned int events;    /**< The events ready, as for @c Poll */
+} event_t;
+
+
+/**
+	@brief Create an event queue.
+
+	An event queue is a stream which keeps a set of streams of interest,
+	and a list of those which may be ready. Streams enter the ready list 
+	when their state changes, so that @c EventWait costs in proportion to 
+	the number of ready streams, and not to the number of streams 
+	of interest, as @c Poll does.
+
+	The event queue is destroyed when its last file id is closed.
+
+	@returns a file id for the event queue, or NOFILE on error. Possible
+	    reasons for error:
+		- the available file ids for the process are exhausted.
+	@see EventCtl
+	@see EventWait
+*/
+Fid_t EventCreate();
+
+
+/**
+	@brief Change the streams of an event queue.
+
+	A stream is added with @c EVENT_ADD and removed with @c EVENT_DEL;
+	@c EVENT_MOD changes its events of interest (a combination of 
+	@c POLL_READ and @c POLL_WRITE). Streams are identified by their file 
+	id. When the file id is closed (or replaced by @c Dup2), the stream 
+	is removed from the event queue, and its file id may be added again
+	for another stream. The event queue lets go of the stream at once if
+	a thread is in @c EventWait, else at the next call on the queue.
+
+	@param efid the file id of the event queue
+	@param op the operation
+	@param fid the file id of the stream
+	@param events the events of interest
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- @c efid is not an event queue.
+		- @c fid is not a legal file id, or it is an event queue.
+		- @c op is @c EVENT_ADD and @c fid is already in the event queue.
+		- @c op is @c EVENT_MOD or @c EVENT_DEL and @c fid is not in the event queue.
+*/
+int EventCtl(Fid_t efid, int op, Fid_t fid, unsigned int events);
+
+
+/**
+	@brief Wait for the streams of an event queue to become ready.
+
+	Up to @c n ready streams are stored into @c evs. A stream is reported
+	for as long as it is ready (the events are level-triggered).
+	@c POLL_HANGUP and @c POLL_ERROR are always reported.
+
+	@param efid the file id of the event queue
+	@param evs the array to store the ready streams
+	@param n the size of @c evs
+	@param timeout the maximum time to wait, as for @c Poll
+	@returns the number of ready streams stored in @c evs, 0 if the timeout 
+	    expired, or -1 on error. Possible reasons for error:
+		- @c efid is not an event queue.
+		- @c evs is NULL, or @c n is 0.
+*/
+int EventWait(Fid_t efid, event_t* evs, unsigned int n, timeout_t timeout);
+
+
+
+/*******************************************
+ *
+ * Asynchronous I/O
+ *
+ *******************************************/
+
+/** @brief Asynchronous operations. */
+typedef enum {
+  AIO_NOP = 0,      /**< Do nothing, complete with result 0 */
+  AIO_READ = 1,     /**< @c Read into @c buf */
+  AIO_WRITE = 2     /**< @c Write from @c buf */
+} aio_opcode;
+
+
+/** @brief A submission entry. */
+typedef struct aio_sqe_s {
+  unsigned int opcode;        /**< The operation */
+  Fid_t fid;                  /**< The stream */
+  void* buf;                  /**< The buffer */
+  unsigned int len;           /**< The size of the buffer */
+  unsigned long user_data;    /**< Copied into the completion entry */
+} aio_sqe_t;
+
+
+/** @brief A completion entry. */
+typedef struct aio_cqe_s {
+  unsigned long user_data;    /**< As in the submission entry */
+  int result;                 /**< The return value of the operation */
+} aio_cqe_t;
+
+
+/** @brief The submission and completion rings of an asynchronous I/O stream.
+
+  The rings are shared between the process and the kernel. The process fills 
+  the submission entry at @c sq_tail and then increments @c sq_tail; the kernel
+  takes entries from @c sq_head. The kernel posts completions at @c cq_tail, 
+  and the process reaps them from @c cq_head, incrementing it. The indices 
+  increase forever; entry @c i is at position @c i modulo the ring size.
+
+  @see AioSetup
+ */
+typedef struct aio_ring_s {
+  unsigned long sq_head;      /**< Next submission taken by the kernel */
+  unsigned long sq_tail;      /**< Next submission filled by the process */
+  unsigned long cq_head;      /**< Next completion reaped by the process */
+  unsigned long cq_tail;      /**< Next completion posted by the kernel */
+  unsigned int sq_entries;    /**< The size of @c sq, a power of 2 */
+  unsigned int cq_entries;    /**< The size of @c cq, twice @c sq_entries */
+  aio_sqe_t* sq;              /**< The submission ring */
+  aio_cqe_t* cq;              /**< The completion ring */
+} aio_ring_t;
+
+
+/**
+	@brief Create an asynchronous I/O stream.
+
+	The stream owns a pair of submission and completion rings, and the 
+	kernel threads which execute the submitted operations. The rings 
+	remain valid until the stream is closed. Closing the stream cancels 
+	the operations which have not started.
+
+	Operations which have started are not cancelled, and they complete
+	into their buffers even after the stream is closed, or the process 
+	has exited. Therefore, the buffer of an operation must remain valid
+	until its completion has been reaped.
+
+	The stream can be polled; it is readable when there are completions 
+	to reap.
+
+	@param entries the size of the submission ring, rounded up to a power of 2
+	@param ring a location to store a pointer to the rings
+	@returns a file id for the stream, or NOFILE on error. Possible reasons
+	    for error:
+		- @c entries is 0 or larger than 4096, or @c ring is NULL.
+		- the available file ids for the process are exhausted.
+*/
+Fid_t AioSetup(unsigned int entries, aio_ring_t** ring);
+
+
+/**
+	@brief Submit queued operations, and wait for completions.
+
+	All entries filled in the submission ring are taken by the kernel, 
+	with a single lookup of the file ids, and queued for execution. 
+	Operations on illegal file ids complete at once with result -1. 
+	Entries are only taken while there is room for their completions.
+
+	Then, the call waits until at least @c min_complete completions 
+	are available in the completion ring, or the timeout expires.
+
+	@param aio the file id of the asynchronous I/O stream
+	@param min_complete the number of completions to wait for
+	@param timeout the maximum time to wait, as for @c Poll
+	@returns the number of entries submitted, or -1 on error. Possible 
+	    reasons for error:
+		- @c aio is not an asynchronous I/O stream.
+*/
+int AioSubmit(Fid_t aio, unsigned int min_complete, timeout_t timeout);
+
+
+
+
+/*******************************************
+ *
+ * Shared memory and channels
+ *
+ *******************************************/
+
+/**
+	@brief Create a shared memory segment.
+
+	The segment is a stream, whose memory is obtained by @ref ShmMap.
+	Any process holding a fid of the segment (for example, a child which
+	inherited it through @c Exec) can map it, and see the same memory.
+	The memory is initialized to zero.
+
+	The segment cannot be read or written as a stream. It is destroyed
+	when the last fid referring to it is closed.
+
+	@param size the size of the segment in bytes
+	@returns a file id for the segment, or NOFILE on error. Possible 
+	    reasons for error:
+		- @c size is 0 or larger than 1 GB.
+		- the available file ids for the process are exhausted.
+*/
+Fid_t ShmCreate(unsigned int size);
+
+
+/**
+	@brief Map a shared memory segment.
+
+	The returned memory remains valid as long as the process keeps
+	@c fid (or a copy of it) open.
+
+	@param fid the file id of the segment
+	@param size if not NULL, the size of the segment is stored here
+	@returns the address of the segment, or NULL if @c fid is not a 
+	    shared memory segment.
+*/
+void* ShmMap(Fid_t fid, unsigned int* size);
+
+
+/**
+	@brief Create a channel of fixed-size records.
+
+	A channel holds a ring of @c slots records of up to @c slotsize bytes 
+	each. Like a pipe, it has a write end and a read end. Each @c Write 
+	(or @c WriteV) to the write end stores one record, blocking while the
+	ring is full; each @c Read (or @c ReadV) from the read end returns one
+	record, in the order written, blocking while the ring is empty. If the
+	record is longer than the buffer of @c Read, the rest of it is 
+	discarded. A @c Write of more than @c slotsize bytes fails, and a 
+	@c Write of 0 bytes writes nothing.
+
+	When the write end is closed, @c Read returns the remaining records
+	and then 0 (end of file). When the read end is closed, @c Write 
+	returns -1. Both ends can be polled, and report @c POLL_HANGUP 
+	(resp. @c POLL_ERROR) when the other end is closed.
+
+	The ends are shared with child processes by @c Exec. Any number of 
+	threads may write concurrently. Transfers do not take locks unless 
+	they have to block, so a channel is cheaper than a message pipe 
+	(see @c PipeEx) for small records.
+
+	@param chan a pointer to a pipe_t structure for storing the file ids.
+	@param slots the number of records, rounded up to a power of 2
+	@param slotsize the maximum size of a record
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- @c slots or @c slotsize is 0 or larger than 65536.
+		- the available file ids for the process are exhausted.
+*/
+int ChanCreate(pipe_t* chan, unsigned int slots, unsigned int slotsize);
+
+
+
+
+/*******************************************
+ *
+ * Batched system calls
+ *
+ *******************************************/
+
+/** @brief Operations of @c SysBatch. */
+typedef enum {
+  SYS_PIPE = 1,     /**< @c Pipe, storing the read and write fids in @c fid[0] and @c fid[1] */
+  SYS_DUP2 = 2,     /**< @c Dup2(fid[0], fid[1]) */
+  SYS_CLOSE = 3,    /**< @c Close(fid[0]) */
+  SYS_EXEC = 4      /**< @c Exec(task, argl, args), storing the pid in @c result */
+} sysop_code;
+
+
+/** @brief An operation of a batch. */
+typedef struct sysop_s {
+  int op;           /**< The operation */
+  Fid_t fid[2];     /**< The file ids of the operation */
+  Task task;        /**< The task of @c SYS_EXEC */
+  int argl;         /**< The argument length of @c SYS_EXEC */
+  void* args;       /**< The arguments of @c SYS_EXEC */
+  int result;       /**< Set to the return value of the operation */
+} sysop_t;
+
+
+/**
+	@brief Execute a sequence of system calls at once.
+
+	The operations are executed in order, as if they were called one
+	after the other, but the kernel is entered only once. This is 
+	cheaper for short sequences, such as the redirections around
+	the creation of a child process.
+
+	All operations are executed, even if some fail. The @c result
+	field of each operation is set to its return value.
+
+	@param ops the operations
+	@param n the number of operations
+	@returns the number of operations which succeeded, or -1 if 
+	    @c ops is NULL.
+*/
+int SysBatch(sysop_t* ops, unsigned int n);
+
+
+
 
 /*******************************************
  *
@@ -755,7 +1375,13 @@ typedef struct procinfo
 
 	There is no guarantee of the timeliness of the information.
 	A best-effort approach to return relevant system information is
-	made. 
+	made. Each structure is a consistent snapshot of its process, but
+	reading the stream does not stop the system, so processes may come 
+	and go while it is read.
+
+	A @c Read returns as many whole structures as fit in the buffer, 
+	0 at the end of the stream, and -1 if the buffer cannot hold one
+	structure.
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "tinyoslib.h"
 #include "symposium.h"
@@ -194,6 +195,7 @@ int SystemInfo(size_t argc, const char** argv)
 				pname
 				);
 		}
+		Close(finfo);
 	}
 	printf("\n");
 	return 0;
@@ -251,8 +253,8 @@ int Fibonacci(size_t argc, const char** argv)
 int Capitalize(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r", FIDBUF_AUTO);
+	FILE* fout = fidopen_buffered(1, "w", FIDBUF_AUTO);
 	while((c=fgetc(fin))!=EOF) {
 		fputc(toupper(c), fout);
 	}
@@ -265,8 +267,8 @@ int Capitalize(size_t argc, const char** argv)
 int LowerCase(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r", FIDBUF_AUTO);
+	FILE* fout = fidopen_buffered(1, "w", FIDBUF_AUTO);
 	while((c=fgetc(fin))!=EOF) {
 		fputc(tolower(c), fout);
 	}
@@ -279,8 +281,8 @@ int LowerCase(size_t argc, const char** argv)
 int LineEnum(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r", FIDBUF_AUTO);
+	FILE* fout = fidopen_buffered(1, "w", FIDBUF_AUTO);
 	int atend=1;
 	size_t count=0;
 	while((c=fgetc(fin))!=EOF) {
@@ -309,8 +311,8 @@ int More(size_t argc, const char** argv)
 	}
 
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r", FIDBUF_AUTO);
+	FILE* fout = fidopen_buffered(1, "w", FIDBUF_AUTO);
 	FILE* fkbd = fidopen(1, "r");
 
 	int atend=1;
@@ -323,6 +325,7 @@ int More(size_t argc, const char** argv)
 			if(count % page == 0) {
 				/* Here, we have to use getline, unless we change terminal */
 				fprintf(fout, "press enter to continue:");
+				fflush(fout);
 				(void)getline(&_line, &_lno, fkbd);
 			}
 		}
@@ -345,7 +348,7 @@ int WordCount(size_t argc, const char** argv)
 	nchar = nword = nline = 0;
 	int wspace = 1;
 	char c;
-	FILE* fin = fidopen(0, "r");
+	FILE* fin = fidopen_buffered(0, "r", FIDBUF_AUTO);
 	while((c=fgetc(fin))!=EOF) {
 		nchar++;
 		if(wspace && !isblank(c)) {
@@ -715,6 +718,7 @@ static void send_message(Fid_t sock, void* buf, size_t len)
 	}
 	if(count!=len) {
 		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
+		fidflush();
 		Exit(1);
 	}
 }
@@ -743,16 +747,10 @@ int RemoteClient(size_t argc, const char** argv)
 	send_message(sock, args, argl);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
-	return 0;
+	/* Copy the server data to the display, until the server is done */
+	int rc = CopyStream(sock, 1, UINT_MAX, 0);
+	Close(sock);
+	return (rc<0) ? -1 : 0;
 }
 
 
@@ -829,28 +827,34 @@ int process_line(int argc, const char** argv)
 
 	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
+		/* Redirect, execute and restore in a single batch */
+		sysop_t ops[5];
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
 			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
+			ops[0] = (sysop_t){ .op=SYS_DUP2, .fid={pipe.write, 1} };
+			ops[1] = (sysop_t){ .op=SYS_CLOSE, .fid={pipe.write} };
 		} else {
 			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			ops[0] = (sysop_t){ .op=SYS_DUP2, .fid={saveout, 1} };
+			ops[1] = (sysop_t){ .op=SYS_CLOSE, .fid={saveout} };
 		}
 
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
+		BatchExecute(&ops[2], COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
 
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
+			ops[3] = (sysop_t){ .op=SYS_DUP2, .fid={pipe.read, 0} };
+			ops[4] = (sysop_t){ .op=SYS_CLOSE, .fid={pipe.read} };
 		} else {
 			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
+			ops[3] = (sysop_t){ .op=SYS_DUP2, .fid={savein, 0} };
+			ops[4] = (sysop_t){ .op=SYS_CLOSE, .fid={savein} };
 		}
+
+		SysBatch(ops, 5);
+		child[i] = ops[2].result;
+		free(ops[2].args);
 	}
 
 	/* Wait for the children */
@@ -11,20 +11,41 @@
 
 
 
+/* 
+	The cookie of a fid stream. Buffered streams are kept in a list,
+	so that fidflush can find the streams of a process.
+ */
+typedef struct fid_stream {
+	Fid_t fid;
+	Pid_t owner;
+	FILE* file;
+	rlnode node;
+} fid_stream;
+
+static rlnode fid_streams = { .prev = &fid_streams, .next = &fid_streams };
+static Mutex fid_streams_lock = MUTEX_INIT;
+
+FILE *saved_in = NULL, *saved_out = NULL;
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	int ret = Write(((fid_stream*)cookie)->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* fs = (fid_stream*) cookie;
+	Mutex_Lock(&fid_streams_lock);
+	rlist_remove(&fs->node);
+	Mutex_Unlock(&fid_streams_lock);
+	free(fs);
 	return 0;
 }
 
@@ -38,6 +59,7 @@ static cookie_io_functions_t  tinyos_fid_functions =
 
 static FILE* get_std_stream(int fid, const char* mode)
 {
+	/* Shared by all processes, without locking, so it must not buffer */
 	FILE* term = fidopen(fid, mode);
 	assert(term);
 	/* This is glibc-specific and tunrs off fstream locking */
@@ -48,16 +70,70 @@ static FILE* get_std_stream(int fid, const char* mode)
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	return fidopen_buffered(fid, mode, FIDBUF_NONE);
+}
+
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int buffering)
+{
+	int bufmode;
+	switch(buffering) {
+	case FIDBUF_NONE: bufmode = _IONBF; break;
+	case FIDBUF_LINE: bufmode = _IOLBF; break;
+	case FIDBUF_FULL: bufmode = _IOFBF; break;
+	case FIDBUF_AUTO: {
+		/* If in doubt, do not hold back output */
+		int flags = GetFidFlags(fid);
+		bufmode = (flags == -1 || (flags & FID_TERMINAL)) ? _IOLBF : _IOFBF;
+		break;
+	}
+	default:
+		return NULL;
+	}
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
+	fid_stream* fs = (fid_stream *) malloc(sizeof(fid_stream));
+	fs->fid = fid;
+	fs->owner = GetPid();
+	rlnode_init(&fs->node, fs);
+	FILE* f = fopencookie(fs, mode, tinyos_fid_functions);
+	if(f == NULL) {
+		free(fs);
+		return NULL;
+	}
+	fs->file = f;
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+	CHECKRC(setvbuf(f, NULL, bufmode, 0));
+	if(bufmode != _IONBF) {
+		Mutex_Lock(&fid_streams_lock);
+		rlist_push_back(&fid_streams, &fs->node);
+		Mutex_Unlock(&fid_streams_lock);
+	}
 	return f;
 }
 
-FILE *saved_in = NULL, *saved_out = NULL;
+
+void fidflush()
+{
+	Pid_t pid = GetPid();
+	rlnode mine;
+	rlnode_init(&mine, NULL);
+
+	/* Flush outside the lock, since writes may block */
+	Mutex_Lock(&fid_streams_lock);
+	for(rlnode* p = fid_streams.next; p != &fid_streams; ) {
+		rlnode* next = p->next;
+		if(((fid_stream*)p->obj)->owner == pid)
+			rlist_push_back(&mine, rlist_remove(p));
+		p = next;
+	}
+	Mutex_Unlock(&fid_streams_lock);
+
+	for(rlnode* p = mine.next; p != &mine; p = p->next)
+		fflush(((fid_stream*)p->obj)->file);
+
+	Mutex_Lock(&fid_streams_lock);
+	rlist_append(&fid_streams, &mine);
+	Mutex_Unlock(&fid_streams_lock);
+}
 
 
 void tinyos_replace_stdio()
@@ -107,8 +183,10 @@ static int exec_wrapper(int argl, void* args)
 	const char* argv[argc];
 	argvunpack(argc, argv, argl, args);
 
-	/* Make the call */
-	return prog(argc, argv);
+	/* Make the call, and flush what the program left buffered */
+	int exitval = prog(argc, argv);
+	fidflush();
+	return exitval;
 }
 
 
@@ -166,3 +244,45 @@ int Execute(Program prog, size_t argc, const char** argv)
 	return Exec(exec_wrapper, argl, args);
 }
 
+
+void BatchExecute(sysop_t* op, Program prog, size_t argc, const char** argv)
+{
+	/* Pack as in Execute, but into a heap buffer */
+	size_t argl = argvlen(argc, argv) + sizeof(prog);
+	char* args = malloc(argl);
+	memcpy(args, &prog, sizeof(prog));
+	argvpack(args+sizeof(prog), argc, argv);
+
+	op->op = SYS_EXEC;
+	op->task = exec_wrapper;
+	op->argl = argl;
+	op->args = args;
+}
+
+
+
+aio_sqe_t* AioGetSqe(aio_ring_t* ring)
+{
+	unsigned long head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+	if(ring->sq_tail - head >= ring->sq_entries)
+		return NULL;
+	return & ring->sq[ring->sq_tail & (ring->sq_entries-1)];
+}
+
+void AioQueueSqe(aio_ring_t* ring)
+{
+	__atomic_store_n(&ring->sq_tail, ring->sq_tail+1, __ATOMIC_RELEASE);
+}
+
+aio_cqe_t* AioPeekCqe(aio_ring_t* ring)
+{
+	unsigned long tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+	if(ring->cq_head == tail)
+		return NULL;
+	return & ring->cq[ring->cq_head & (ring->cq_entries-1)];
+}
+
+void AioSeenCqe(aio_ring_t* ring)
+{
+	__atomic_store_n(&ring->cq_head, ring->cq_head+1, __ATOMIC_RELEASE);
+}
@@ -16,11 +16,51 @@
 /**
     @brief Open a C stream on a tinyos file descriptor.
 
+	The stream is unbuffered, i.e., @c fidopen_buffered with
+	@c FIDBUF_NONE.
 	This call returns a new FILE pointer on success and NULL
 	on failure.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
+/** @brief Buffering modes of fid streams. 
+
+	@see fidopen_buffered
+ */
+enum fid_buffering {
+	FIDBUF_NONE,	/**< Every C stream operation is a system call */
+	FIDBUF_LINE,	/**< Output is written at each newline */
+	FIDBUF_FULL,	/**< Output is written when the buffer fills */
+	FIDBUF_AUTO		/**< Line buffered for terminals, else fully buffered */
+};
+
+/**
+    @brief Open a buffered C stream on a tinyos file descriptor.
+
+	Buffered output is written when the stream is flushed or closed,
+	and by @c fidflush. A buffered input stream may read ahead, so the
+	data it holds is lost to other readers of the file id.
+
+	This call returns a new FILE pointer on success and NULL
+	on failure.
+*/
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int buffering);
+
+/**
+    @brief Flush the buffered fid streams of the current process.
+
+	This is called when the main task of a program started by @c Execute
+	returns. Programs which call @c Exit should call it first.
+*/
+void fidflush();
+
+/**
+	@brief Replace the C standard streams with streams on file ids 0 and 1.
+
+	The streams are shared by all processes, and refer to file ids 0 and 1
+	of the process which uses them. Therefore, they are unbuffered; 
+	programs should use @c fidopen_buffered for their own streams.
+*/
 void tinyos_replace_stdio();
 void tinyos_restore_stdio();
 void tinyos_pseudo_console();
@@ -44,6 +84,17 @@ typedef int (*Program)(size_t argc, const char** argv);
 int Execute(Program prog, size_t argc, const char** argv);
 
 
+/**
+	@brief Fill in a batch operation which executes a program, as @ref Execute.
+
+	The arguments are packed into a buffer allocated by @c malloc, which
+	is stored in @c op->args. The caller should free it after @c SysBatch
+	returns.
+	@see SysBatch
+  */
+void BatchExecute(sysop_t* op, Program prog, size_t argc, const char** argv);
+
+
 /**
 	@brief Try to reclaim the arguments of a process.
 
@@ -73,4 +124,31 @@ int Execute(Program prog, size_t argc, const char** argv);
 int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
+/**
+	@brief Return the next free submission entry of an asynchronous I/O ring.
+
+	The entry is submitted to the kernel after it is filled and
+	passed to @ref AioQueueSqe. Returns NULL if the submission ring is full.
+	@see AioSetup
+*/
+aio_sqe_t* AioGetSqe(aio_ring_t* ring);
+
+/**
+	@brief Queue the entry returned by @ref AioGetSqe, for the next @c AioSubmit.
+*/
+void AioQueueSqe(aio_ring_t* ring);
+
+/**
+	@brief Return the next completion of an asynchronous I/O ring, or NULL.
+
+	The completion must be released by @ref AioSeenCqe, after it is used.
+*/
+aio_cqe_t* AioPeekCqe(aio_ring_t* ring);
+
+/**
+	@brief Release the completion returned by @ref AioPeekCqe.
+*/
+void AioSeenCqe(aio_ring_t* ring);
+
+
 #endif
@@ -44,20 +44,12 @@ void exception_unwind(exception_context context, int errcode)
 }
 
 int isEmpty(io_buffer *buffer){
-	if(buffer->space.available == IO_BUFFER_CAPACITY){
-		return 1;
-	}
-	else{
-		return 0;
-	}
+	/* No data has been released to readers */
+	return __atomic_load_n(&buffer->data.available, __ATOMIC_ACQUIRE) == 0;
 }
 int isFull(io_buffer *buffer){
-	if(buffer->data.available == IO_BUFFER_CAPACITY){
-		return 1;	
-	}
-	else{
-		return 0;
-	}
+	/* No space has been released to writers */
+	return __atomic_load_n(&buffer->space.available, __ATOMIC_ACQUIRE) == 0;
 }
 
 uint io_buffer_segment_reserve(io_buffer_segment* this, uint size, uint* pos)
@@ -419,6 +419,86 @@ BOOT_TEST(test_close_success_on_valid_nonfile_fid,
 	return 0;
 }
 
+BOOT_TEST(test_fid_table_grows,
+	"Test that the fid table holds MAX_FILEID fids, allocating the lowest free fid."
+	)
+{
+	for(Fid_t i=0; i<MAX_FILEID; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(OpenNull()==NOFILE);
+
+	ASSERT(Close(MAX_FILEID/2)==0);
+	ASSERT(Close(100)==0);
+	ASSERT(OpenNull()==100);
+	ASSERT(OpenNull()==MAX_FILEID/2);
+
+	for(Fid_t i=3; i<MAX_FILEID; i++)
+		ASSERT(Close(i)==0);
+	ASSERT(Dup2(0, MAX_FILEID-1)==0);
+	ASSERT(OpenNull()==3);
+	char c = 'x';
+	ASSERT(Read(MAX_FILEID-1, &c, 1)==1 && c==0);
+	return 0;
+}
+
+
+static int info_child(int argl, void* args)
+{
+	char c;
+	Read(0, &c, 1);    /* wait for the parent */
+	return 0;
+}
+
+/* Find pid in an info stream, returns 0 if it is not listed */
+static int find_procinfo(Pid_t pid, procinfo* info)
+{
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	int found = 0;
+	procinfo buf[4];
+	int rc;
+	while((rc = Read(finfo, (char*) buf, sizeof(buf))) > 0) {
+		ASSERT(rc % sizeof(procinfo) == 0);
+		for(int i=0; i<rc/sizeof(procinfo); i++)
+			if(buf[i].pid == pid) {
+				*info = buf[i];
+				found = 1;
+			}
+	}
+	ASSERT(rc==0);
+	ASSERT(Close(finfo)==0);
+	return found;
+}
+
+BOOT_TEST(test_open_info,
+	"Test that the info stream lists the processes in use, with their arguments."
+	)
+{
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	char small[sizeof(procinfo)-1];
+	ASSERT(Read(finfo, small, sizeof(small))==-1);
+	ASSERT(Close(finfo)==0);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Dup2(pipe.read, 0)==0);
+	Pid_t child = Exec(info_child, 6, "hello");
+	ASSERT(child!=NOPROC);
+
+	procinfo info;
+	ASSERT(find_procinfo(GetPid(), &info) && info.alive);
+	ASSERT(find_procinfo(child, &info));
+	ASSERT(info.alive && info.ppid==GetPid() && info.main_task==info_child);
+	ASSERT(info.argl==6 && strcmp(info.args, "hello")==0);
+
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(WaitChild(child, NULL)==child);
+	ASSERT(! find_procinfo(child, &info));
+	return 0;
+}
+
+
 BOOT_TEST(test_close_terminals,
 	"Test that terminals can be opened and then closed without error."
 	)
@@ -495,6 +575,54 @@ BOOT_TEST(test_read_kbd_big,
 }
 
 
+BOOT_TEST(test_read_kbd_canonical,
+	"Test that in canonical mode, reads return whole lines with erasures applied.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(SetTerminalMode(fterm, TERM_CANON)==0);
+	ASSERT(SetTerminalMode(fterm, 8)==-1);
+
+	sendme(0, "Helo\bl");
+	sendme(0, "o\nworld\n\x04");
+
+	char buffer[64];
+	ASSERT(Read(fterm, buffer, 64)==6);
+	ASSERT(memcmp(buffer, "Hello\n", 6)==0);
+	ASSERT(Read(fterm, buffer, 64)==6);
+	ASSERT(memcmp(buffer, "world\n", 6)==0);
+	ASSERT(Read(fterm, buffer, 64)==0);
+
+	ASSERT(SetTerminalMode(fterm, TERM_RAW)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_read_kbd_canonical_eof_line,
+	"Test that in canonical mode, a line completed by ctrl-D is read by itself.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(SetTerminalMode(fterm, TERM_CANON)==0);
+
+	sendme(0, "abc\x04");
+	sendme(0, "def\n");
+
+	char buffer[64];
+	ASSERT(Read(fterm, buffer, 64)==3);
+	ASSERT(memcmp(buffer, "abc", 3)==0);
+	ASSERT(Read(fterm, buffer, 64)==4);
+	ASSERT(memcmp(buffer, "def\n", 4)==0);
+
+	ASSERT(SetTerminalMode(fterm, TERM_RAW)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_dup2_copies_file,
 	"This test copies that Dup2 copies the file to another file descriptor.",
 	.minimum_terminals = 1
@@ -754,9 +882,13 @@ TEST_SUITE(basic_tests,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
+	&test_fid_table_grows,
+	&test_open_info,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
+	&test_read_kbd_canonical,
+	&test_read_kbd_canonical_eof_line,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
 	&test_write_con,
@@ -937,6 +1069,718 @@ BOOT_TEST(test_pipe_close_writer,
 }
 
 
+BOOT_TEST(test_pipe_watermarks,
+	"Test that a pipe with a low watermark delivers data in batches, and all of it after close."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	Fid_t fnull = OpenNull();
+	ASSERT(PipeSetWatermarks(fnull, 1, 100)==-1);
+	ASSERT(PipeSetWatermarks(pipe.read, 0, 100)==-1);
+	ASSERT(PipeSetWatermarks(pipe.read, 1, 1<<20)==-1);
+	ASSERT(PipeSetWatermarks(pipe.write, 10, 100)==0);
+
+	char buffer[64];
+	ASSERT(Write(pipe.write, "Hell", 4)==4);
+	ASSERT(Write(pipe.write, "o world!", 8)==8);
+	ASSERT(Read(pipe.read, buffer, 64)==12);
+	ASSERT(memcmp(buffer, "Hello world!", 12)==0);
+
+	ASSERT(Write(pipe.write, "bye", 3)==3);
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, buffer, 64)==3);
+	ASSERT(Read(pipe.read, buffer, 64)==0);
+	return 0;
+}
+
+
+static int idle_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	for(volatile int i=0; i<1000000; i++);
+	ASSERT(Write(fid, "abc", 3)==3);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_low_mark_idle_writer,
+	"Test that a reader gets the data of a writer which stops below the low watermark."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(PipeSetWatermarks(pipe.read, 100, 1000)==0);
+
+	char buffer[64];
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	ASSERT(Read(pipe.read, buffer, 64)==5);
+
+	/* The reader sleeps on the empty pipe first */
+	ASSERT(Exec(idle_writer, sizeof(Fid_t), &pipe.write)!=NOPROC);
+	ASSERT(Read(pipe.read, buffer, 64)==3);
+	ASSERT(memcmp(buffer, "abc", 3)==0);
+	WaitChild(NOPROC, NULL);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_limit,
+	"Test that the pipe buffer grows up to the pipe limit."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(PipeSetLimit(pipe.read, 1)==-1);
+	ASSERT(PipeSetLimit(pipe.write, 256*1024)==0);
+
+	static char buffer[256*1024];
+	FUDGE(buffer);
+	ASSERT(Write(pipe.write, buffer, 200000)==200000);
+	ASSERT(Write(pipe.write, buffer, 100000)==256*1024-200000);
+
+	uint count = 0;
+	while(count < 256*1024) {
+		int rc = Read(pipe.read, buffer, 4000);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(count == 256*1024);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice,
+	"Test that Splice moves data from a pipe to another pipe and to the null device."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull!=NOFILE);
+
+	ASSERT(Splice(p1.write, p2.write, 10)==-1);
+	ASSERT(Splice(p1.read, p1.write, 10)==-1);
+
+	char buffer[64];
+	ASSERT(Write(p1.write, "Hello world, bye", 16)==16);
+	ASSERT(Splice(p1.read, p2.write, 12)==12);
+	ASSERT(Read(p2.read, buffer, 64)==12);
+	ASSERT(memcmp(buffer, "Hello world,", 12)==0);
+
+	ASSERT(Splice(p1.read, fnull, 64)==4);
+	Close(p1.write);
+	ASSERT(Splice(p1.read, p2.write, 64)==0);
+
+	Close(p2.read);
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Write(p1.write, "x", 1)==1);
+	ASSERT(Splice(p1.read, p2.write, 1)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_tee,
+	"Test that Tee duplicates the data of a pipe without consuming it."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	ASSERT(Tee(p1.read, p1.write, 10)==-1);
+	ASSERT(Tee(p1.read, p2.read, 10)==-1);
+
+	/* Span more than one page */
+	static char data[10000];
+	for(int i=0; i<10000; i++) data[i] = i % 251;
+	ASSERT(Write(p1.write, data, 10000)==10000);
+
+	ASSERT(Tee(p1.read, p2.write, 20000)==10000);
+
+	static char buffer[10000];
+	uint count = 0;
+	while(count < 10000) {
+		int rc = Read(p2.read, buffer+count, 10000-count);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(memcmp(buffer, data, 10000)==0);
+
+	count = 0;
+	while(count < 10000) {
+		int rc = Read(p1.read, buffer+count, 10000-count);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(memcmp(buffer, data, 10000)==0);
+
+	Close(p1.write);
+	ASSERT(Tee(p1.read, p2.write, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_readv_writev,
+	"Test that ReadV and WriteV gather and scatter data on pipes and devices."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	iovec_t out[3] = { { "Hello", 5 }, { NULL, 0 }, { " world", 6 } };
+	ASSERT(WriteV(pipe.write, out, 3)==11);
+
+	char b1[4], b2[16];
+	iovec_t in[2] = { { b1, 4 }, { b2, 16 } };
+	ASSERT(ReadV(pipe.read, in, 2)==11);
+	ASSERT(memcmp(b1, "Hell", 4)==0);
+	ASSERT(memcmp(b2, "o world", 7)==0);
+
+	/* Streams without vectored operations */
+	Fid_t fnull = OpenNull();
+	ASSERT(WriteV(fnull, out, 3)==11);
+	ASSERT(ReadV(fnull, in, 2)==4);
+
+	ASSERT(ReadV(NOFILE, in, 2)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_message_mode,
+	"Test that a message pipe returns one whole message per Read."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, 42)==-1);
+	ASSERT(PipeEx(&pipe, PIPE_MESSAGE)==0);
+	ASSERT(PipeSetWatermarks(pipe.read, 10, 100)==-1);
+
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	ASSERT(Write(pipe.write, "", 0)==0);
+	iovec_t out[2] = { { "big ", 4 }, { "world", 5 } };
+	ASSERT(WriteV(pipe.write, out, 2)==9);
+	ASSERT(Write(pipe.write, "truncated", 9)==9);
+
+	static char big[(1<<20)];
+	ASSERT(Write(pipe.write, big, (1<<20))==-1);
+
+	char buffer[64];
+	ASSERT(Read(pipe.read, buffer, 64)==5);
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	ASSERT(Read(pipe.read, buffer, 64)==9);
+	ASSERT(memcmp(buffer, "big world", 9)==0);
+	ASSERT(Read(pipe.read, buffer, 5)==5);
+	ASSERT(memcmp(buffer, "trunc", 5)==0);
+
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, buffer, 64)==0);
+	return 0;
+}
+
+
+static int message_writer(int argl, void* args)
+{
+	static char msg[5000];
+	ASSERT(Write(*(Fid_t*)args, msg, sizeof(msg))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_message_limit_lowered,
+	"Test that a message writer fails when the pipe limit is lowered below its message."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, PIPE_MESSAGE)==0);
+	ASSERT(PipeSetLimit(pipe.write, 8192)==0);
+
+	static char buffer[4000];
+	ASSERT(Write(pipe.write, buffer, 4000)==4000);
+
+	/* The writer waits for room, or finds the limit already lowered */
+	ASSERT(Exec(message_writer, sizeof(Fid_t), &pipe.write)!=NOPROC);
+	for(volatile int i=0; i<1000000; i++);
+	ASSERT(PipeSetLimit(pipe.read, 4096)==0);
+	WaitChild(NOPROC, NULL);
+
+	ASSERT(Read(pipe.read, buffer, 4000)==4000);
+	ASSERT(Write(pipe.write, buffer, 4000)==4000);
+	return 0;
+}
+
+
+static int poll_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	for(volatile int i=0; i<1000000; i++);
+	ASSERT(Write(fid, "x", 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_poll_nonblock,
+	"Test that Poll waits for pipe events, and that non-blocking fids do not block."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(GetFidFlags(pipe.read)==0);
+	ASSERT(SetFidFlags(pipe.read, 42)==-1);
+	ASSERT(SetFidFlags(NOFILE, FID_NONBLOCK)==-1);
+	ASSERT(SetFidFlags(pipe.read, FID_NONBLOCK)==0);
+	ASSERT(GetFidFlags(pipe.read)==FID_NONBLOCK);
+
+	char buffer[16];
+	ASSERT(Read(pipe.read, buffer, 16)==-1);
+
+	Fid_t fids[3] = { pipe.read, pipe.write, NOFILE };
+	unsigned int ev[3] = { POLL_READ, POLL_READ|POLL_WRITE, POLL_READ };
+	ASSERT(Poll(fids, ev, 3, 0)==1);
+	ASSERT(ev[0]==0 && ev[1]==POLL_WRITE && ev[2]==0);
+
+	ev[0] = POLL_READ;
+	ASSERT(Poll(fids, ev, 1, 20)==0);
+
+	/* Wait until a child writes */
+	ASSERT(Exec(poll_writer, sizeof(Fid_t), &pipe.write)!=NOPROC);
+	ev[0] = POLL_READ;
+	ASSERT(Poll(fids, ev, 1, -1)==1);
+	ASSERT(ev[0]==POLL_READ);
+	ASSERT(Read(pipe.read, buffer, 16)==1);
+	WaitChild(NOPROC, NULL);
+
+	/* Hang up */
+	Close(pipe.write);
+	ev[0] = POLL_READ;
+	ASSERT(Poll(fids, ev, 1, -1)==1);
+	ASSERT(ev[0]==POLL_HANGUP);
+	ASSERT(Read(pipe.read, buffer, 16)==0);
+
+	/* Closed file ids */
+	ev[1] = POLL_WRITE;
+	ASSERT(Poll(fids+1, ev+1, 1, -1)==1);
+	ASSERT(ev[1]==POLL_INVALID);
+
+	/* A non-blocking writer stops at a full pipe */
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(SetFidFlags(pipe.write, FID_NONBLOCK)==0);
+	int n, total = 0;
+	while((n = Write(pipe.write, buffer, 16)) > 0 && total < (1<<24))
+		total += n;
+	ASSERT(n==-1 && total > 0);
+	iovec_t iov = { buffer, 16 };
+	ASSERT(WriteV(pipe.write, &iov, 1)==-1);
+	Close(pipe.read);
+	Close(pipe.write);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_event_queue,
+	"Test that an event queue reports the ready pipes."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	Fid_t eq = EventCreate();
+	ASSERT(eq!=NOFILE);
+	ASSERT(EventCtl(p1.read, EVENT_ADD, p2.read, POLL_READ)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, eq, POLL_READ)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, p1.read, POLL_READ)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, p1.read, POLL_READ)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, p2.read, POLL_READ)==0);
+	ASSERT(EventCtl(eq, EVENT_MOD, p2.write, POLL_WRITE)==-1);
+
+	event_t ev[4];
+	ASSERT(EventWait(eq, ev, 0, 0)==-1);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	ASSERT(Write(p2.write, "abc", 3)==3);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].fid==p2.read && ev[0].events==POLL_READ);
+	/* Level-triggered */
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+
+	char buffer[16];
+	ASSERT(Read(p2.read, buffer, 16)==3);
+	ASSERT(EventWait(eq, ev, 4, 10)==0);
+
+	/* Wait until a child writes */
+	ASSERT(Exec(poll_writer, sizeof(Fid_t), &p1.write)!=NOPROC);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].fid==p1.read && ev[0].events==POLL_READ);
+	ASSERT(Read(p1.read, buffer, 16)==1);
+	WaitChild(NOPROC, NULL);
+
+	ASSERT(EventCtl(eq, EVENT_DEL, p1.read, 0)==0);
+	ASSERT(EventCtl(eq, EVENT_DEL, p1.read, 0)==-1);
+	Close(p2.write);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].fid==p2.read && ev[0].events==POLL_HANGUP);
+
+	/* Closing the file id removes the stream */
+	Close(p2.read);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	ASSERT(Close(eq)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_queue_fid_reuse,
+	"Test that closing a file id removes it from an event queue, and that the file id can be reused."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Fid_t eq = EventCreate();
+	ASSERT(eq!=NOFILE);
+
+	/* The queue does not keep a closed write end open */
+	Fid_t fid = p1.write;
+	ASSERT(EventCtl(eq, EVENT_ADD, fid, POLL_WRITE)==0);
+	ASSERT(Close(fid)==0);
+	event_t ev[4];
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+	char buffer[16];
+	ASSERT(Read(p1.read, buffer, 16)==0);
+
+	/* The file id now refers to another stream */
+	ASSERT(Dup2(p2.read, fid)==0);
+	ASSERT(EventCtl(eq, EVENT_DEL, fid, 0)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, fid, POLL_READ)==0);
+	ASSERT(Write(p2.write, "abc", 3)==3);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].fid==fid && ev[0].events==POLL_READ);
+
+	/* Replacing the file id by Dup2 removes it too */
+	ASSERT(Dup2(p1.read, fid)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+	ASSERT(EventCtl(eq, EVENT_MOD, fid, POLL_READ)==-1);
+
+	ASSERT(Close(eq)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_aio,
+	"Test that asynchronous reads and writes on a pipe complete."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	aio_ring_t* ring;
+	ASSERT(AioSetup(0, &ring)==NOFILE);
+	Fid_t aio = AioSetup(3, &ring);
+	ASSERT(aio!=NOFILE);
+	ASSERT(ring->sq_entries==4);
+	ASSERT(AioPeekCqe(ring)==NULL);
+	ASSERT(AioSubmit(pipe.read, 0, 0)==-1);
+
+	/* The read is queued before the write it waits for */
+	char rbuf[16];
+	aio_sqe_t* sqe;
+	ASSERT((sqe=AioGetSqe(ring))!=NULL);
+	*sqe = (aio_sqe_t){ .opcode=AIO_READ, .fid=pipe.read, .buf=rbuf, .len=16, .user_data=1 };
+	AioQueueSqe(ring);
+	ASSERT((sqe=AioGetSqe(ring))!=NULL);
+	*sqe = (aio_sqe_t){ .opcode=AIO_WRITE, .fid=pipe.write, .buf="hello", .len=5, .user_data=2 };
+	AioQueueSqe(ring);
+	ASSERT((sqe=AioGetSqe(ring))!=NULL);
+	*sqe = (aio_sqe_t){ .opcode=AIO_NOP, .user_data=3 };
+	AioQueueSqe(ring);
+	ASSERT((sqe=AioGetSqe(ring))!=NULL);
+	*sqe = (aio_sqe_t){ .opcode=AIO_READ, .fid=MAX_FILEID-1, .buf=rbuf, .len=16, .user_data=4 };
+	AioQueueSqe(ring);
+	ASSERT(AioGetSqe(ring)==NULL);
+
+	ASSERT(AioSubmit(aio, 4, -1)==4);
+
+	int results[5] = {0};
+	aio_cqe_t* cqe;
+	int count = 0;
+	while((cqe=AioPeekCqe(ring))!=NULL) {
+		ASSERT(cqe->user_data>=1 && cqe->user_data<=4);
+		results[cqe->user_data] = cqe->result;
+		AioSeenCqe(ring);
+		count++;
+	}
+	ASSERT(count==4);
+	ASSERT(results[1]==5 && memcmp(rbuf, "hello", 5)==0);
+	ASSERT(results[2]==5);
+	ASSERT(results[3]==0);
+	ASSERT(results[4]==-1);
+
+	/* Completions can be polled */
+	Fid_t fid = aio;
+	unsigned int ev = POLL_READ;
+	ASSERT(Poll(&fid, &ev, 1, 0)==0);
+	ASSERT((sqe=AioGetSqe(ring))!=NULL);
+	*sqe = (aio_sqe_t){ .opcode=AIO_NOP, .user_data=5 };
+	AioQueueSqe(ring);
+	ASSERT(AioSubmit(aio, 0, 0)==1);
+	ev = POLL_READ;
+	ASSERT(Poll(&fid, &ev, 1, -1)==1 && ev==POLL_READ);
+
+	ASSERT(Close(aio)==0);
+	ASSERT(AioSubmit(aio, 0, 0)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_sys_batch,
+	"Test that a batch sets up a pipe to a child, with per-operation results."
+	)
+{
+	ASSERT(SysBatch(NULL, 1)==-1);
+
+	sysop_t ops[6] = {
+		{ .op=SYS_PIPE }
+	};
+	ASSERT(SysBatch(ops, 1)==1);
+	ASSERT(ops[0].result==0);
+	Fid_t rfid = ops[0].fid[0], wfid = ops[0].fid[1];
+
+	/* The child inherits the write end as fid 5 */
+	Fid_t childfid = 5;
+	ops[0] = (sysop_t){ .op=SYS_DUP2, .fid={wfid, 5} };
+	ops[1] = (sysop_t){ .op=SYS_CLOSE, .fid={wfid} };
+	ops[2] = (sysop_t){ .op=SYS_EXEC, .task=poll_writer, .argl=sizeof(Fid_t), .args=&childfid };
+	ops[3] = (sysop_t){ .op=SYS_CLOSE, .fid={5} };
+	ops[4] = (sysop_t){ .op=SYS_DUP2, .fid={MAX_FILEID, 6} };
+	ops[5] = (sysop_t){ .op=17 };
+	ASSERT(SysBatch(ops, 6)==4);
+	ASSERT(ops[0].result==0 && ops[1].result==0 && ops[3].result==0);
+	ASSERT(ops[2].result!=NOPROC);
+	ASSERT(ops[4].result==-1 && ops[5].result==-1);
+
+	/* Only the child holds the write end */
+	char buffer[4];
+	ASSERT(Read(rfid, buffer, 4)==1 && buffer[0]=='x');
+	ASSERT(Read(rfid, buffer, 4)==0);
+	ASSERT(WaitChild(ops[2].result, NULL)==ops[2].result);
+	return 0;
+}
+
+
+static int shm_child(int argl, void* args)
+{
+	unsigned int size;
+	char* mem = ShmMap(*(Fid_t*)args, &size);
+	ASSERT(mem!=NULL && size==4096);
+	ASSERT(mem[0]=='p');
+	strcpy(mem+2048, "child");
+	return 0;
+}
+
+BOOT_TEST(test_shm_shared_with_child,
+	"Test that a shared memory segment is seen by a child process."
+	)
+{
+	ASSERT(ShmCreate(0)==NOFILE);
+	ASSERT(ShmMap(0, NULL)==NULL);
+
+	Fid_t shm = ShmCreate(4096);
+	ASSERT(shm!=NOFILE);
+	char* mem = ShmMap(shm, NULL);
+	ASSERT(mem!=NULL && mem[4095]==0);
+	char buffer[4];
+	ASSERT(Read(shm, buffer, 4)==-1);
+
+	mem[0] = 'p';
+	Pid_t child = Exec(shm_child, sizeof(Fid_t), &shm);
+	ASSERT(child!=NOPROC);
+	ASSERT(WaitChild(child, NULL)==child);
+	ASSERT(strcmp(mem+2048, "child")==0);
+
+	/* A copy keeps the segment */
+	ASSERT(Dup2(shm, 7)==0);
+	ASSERT(Close(shm)==0);
+	ASSERT(ShmMap(shm, NULL)==NULL);
+	ASSERT(ShmMap(7, NULL)==mem);
+	ASSERT(Close(7)==0);
+	return 0;
+}
+
+
+/* Sends 1000 records {id, i} to the channel, for the ids in args */
+static int chan_producer(int argl, void* args)
+{
+	int* rec = args;
+	Fid_t chan = rec[0];
+	for(int i=0; i<1000; i++) {
+		int msg[2] = { rec[1], i };
+		ASSERT(Write(chan, (char*)msg, sizeof(msg))==sizeof(msg));
+	}
+	return 0;
+}
+
+BOOT_TEST(test_chan_records,
+	"Test that a channel delivers records in order, from many producers."
+	)
+{
+	pipe_t chan;
+	ASSERT(ChanCreate(&chan, 0, 8)==-1);
+	ASSERT(ChanCreate(&chan, 4, 0)==-1);
+	ASSERT(ChanCreate(&chan, 3, 8)==0);
+
+	char buffer[16];
+	Fid_t fids[2] = { chan.read, chan.write };
+	unsigned int ev[2] = { POLL_READ, POLL_WRITE };
+	ASSERT(Poll(fids, ev, 2, 0)==1 && ev[0]==0 && ev[1]==POLL_WRITE);
+	ASSERT(Write(chan.write, "too long a record", 17)==-1);
+	ASSERT(Write(chan.write, "", 0)==0);
+	ASSERT(Write(chan.write, "abc", 3)==3);
+	ASSERT(Write(chan.write, "defghijk", 8)==8);
+	ASSERT(Write(chan.read, "abc", 3)==-1);
+	ev[0] = POLL_READ; ev[1] = POLL_WRITE;
+	ASSERT(Poll(fids, ev, 2, 0)==2 && ev[0]==POLL_READ && ev[1]==POLL_WRITE);
+	ASSERT(Read(chan.read, buffer, 16)==3 && memcmp(buffer, "abc", 3)==0);
+	ASSERT(Read(chan.read, buffer, 4)==4 && memcmp(buffer, "defg", 4)==0);
+
+	/* The ring has 4 slots, so the producers block */
+	int prod[2][2] = { {chan.write, 0}, {chan.write, 1} };
+	ASSERT(Exec(chan_producer, sizeof(prod[0]), prod[0])!=NOPROC);
+	ASSERT(Exec(chan_producer, sizeof(prod[1]), prod[1])!=NOPROC);
+
+	int next[2] = {0, 0};
+	for(int i=0; i<2000; i++) {
+		int msg[2];
+		ASSERT(Read(chan.read, (char*)msg, sizeof(msg))==sizeof(msg));
+		ASSERT(msg[0]==0 || msg[0]==1);
+		ASSERT(msg[1]==next[msg[0]]);
+		next[msg[0]]++;
+	}
+	WaitChild(NOPROC, NULL);
+	WaitChild(NOPROC, NULL);
+
+	/* Hang up: the remaining records, then end of file */
+	ASSERT(Write(chan.write, "bye", 3)==3);
+	ASSERT(Close(chan.write)==0);
+	ev[0] = POLL_READ;
+	ASSERT(Poll(fids, ev, 1, -1)==1 && ev[0]==(POLL_READ|POLL_HANGUP));
+	ASSERT(Read(chan.read, buffer, 16)==3);
+	ASSERT(Read(chan.read, buffer, 16)==0);
+	ASSERT(Close(chan.read)==0);
+
+	/* Sends fail without receivers */
+	ASSERT(ChanCreate(&chan, 4, 8)==0);
+	ASSERT(Close(chan.read)==0);
+	ASSERT(Write(chan.write, "abc", 3)==-1);
+	ev[1] = POLL_WRITE;
+	ASSERT(Poll(&chan.write, ev+1, 1, 0)==1 && ev[1]==POLL_ERROR);
+	ASSERT(Close(chan.write)==0);
+	return 0;
+}
+
+
+/* Writes 1000 bytes of 'x' to the fid in args */
+static int fid_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	for(int i=0; i<1000; i++)
+		ASSERT(Write(fid, "x", 1)==1);
+	return 0;
+}
+
+/* Copies and closes fid 10 repeatedly, then writes a 'D' */
+static int fid_shuffler(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	for(int i=0; i<1000; i++) {
+		ASSERT(Dup2(fid, 10)==0);
+		Write(10, "", 0);
+		ASSERT(Close(10)==0);
+	}
+	ASSERT(Write(fid, "D", 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_io_races_fid_changes,
+	"Test that I/O by many threads is correct while fids are copied and closed."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	for(int i=0; i<4; i++)
+		ASSERT(CreateThread(fid_writer, sizeof(Fid_t), &pipe.write)!=NOTHREAD);
+	ASSERT(CreateThread(fid_shuffler, sizeof(Fid_t), &pipe.write)!=NOTHREAD);
+
+	int count[2] = {0, 0};
+	char buffer[64];
+	while(count[0] < 4000 || count[1] < 1) {
+		int n = Read(pipe.read, buffer, 64);
+		ASSERT(n > 0);
+		for(int i=0; i<n; i++) {
+			ASSERT(buffer[i]=='x' || buffer[i]=='D');
+			count[buffer[i]=='D']++;
+		}
+	}
+	ASSERT(count[0]==4000 && count[1]==1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_buffered_stream,
+	"Test that a buffered stream on a pipe holds output until it is flushed."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT((GetFidFlags(pipe.write) & FID_TERMINAL)==0);
+	ASSERT(SetFidFlags(pipe.read, FID_NONBLOCK)==0);
+	ASSERT(fidopen_buffered(pipe.write, "w", 42)==NULL);
+
+	char buffer[8];
+	FILE* f = fidopen_buffered(pipe.write, "w", FIDBUF_FULL);
+	ASSERT(f!=NULL);
+	fputs("hello", f);
+	ASSERT(Read(pipe.read, buffer, 8)==-1);
+	fidflush();
+	ASSERT(Read(pipe.read, buffer, 8)==5 && memcmp(buffer, "hello", 5)==0);
+
+	fputs("bye", f);
+	ASSERT(fclose(f)==0);
+	ASSERT(Read(pipe.read, buffer, 8)==3 && memcmp(buffer, "bye", 3)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_copy_stream,
+	"Test that CopyStream copies between streams until end of file, or n bytes."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0 && Pipe(&p2)==0);
+	ASSERT(CopyStream(p1.write, p2.write, 10, 0)==-1);
+	ASSERT(CopyStream(p1.read, NOFILE, 10, 0)==-1);
+	ASSERT(CopyStream(MAX_FILEID, p2.write, 10, 0)==-1);
+	ASSERT(CopyStream(p1.read, p2.write, 10, 8)==-1);
+
+	ASSERT(Write(p1.write, "hello world", 11)==11);
+	ASSERT(Close(p1.write)==0);
+	ASSERT(CopyStream(p1.read, p2.write, 5, 0)==5);
+	ASSERT(CopyStream(p1.read, p2.write, 100, 0)==6);
+	ASSERT(CopyStream(p1.read, p2.write, 100, 0)==0);
+
+	char buffer[16];
+	ASSERT(Read(p2.read, buffer, 16)==11 && memcmp(buffer, "hello world", 11)==0);
+
+	/* The null device never ends, so the copy takes several chunks */
+	Fid_t null = OpenNull();
+	ASSERT(CopyStream(null, null, 10000, 0)==10000);
+	int rc = CopyStream(null, null, 10000, COPY_ONCE);
+	ASSERT(rc>0 && rc<10000);
+	return 0;
+}
+
+
 /* Takes one integer argument, writes that many bytes to stdout.
  */
 int data_producer(int argl, void* args)
@@ -1064,6 +1908,24 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_watermarks,
+	&test_pipe_low_mark_idle_writer,
+	&test_pipe_limit,
+	&test_pipe_splice,
+	&test_pipe_tee,
+	&test_pipe_readv_writev,
+	&test_pipe_message_mode,
+	&test_pipe_message_limit_lowered,
+	&test_pipe_poll_nonblock,
+	&test_pipe_event_queue,
+	&test_event_queue_fid_reuse,
+	&test_pipe_aio,
+	&test_pipe_sys_batch,
+	&test_shm_shared_with_child,
+	&test_chan_records,
+	&test_pipe_io_races_fid_changes,
+	&test_pipe_buffered_stream,
+	&test_copy_stream,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
 	NULL